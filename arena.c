@@ -0,0 +1,215 @@
+/*
+ * Arena allocation of the short-lived memory of a directory listing.
+ * Scratch arrays of reading, sorting and printing a directory and the paths
+ * of an R traversal are carved out of large chunks instead of being
+ * malloc(3)ed one by one, and are released together after the directory is
+ * printed. After the first directories, an arena settles on a single chunk
+ * which fits the largest directory, so listing more directories does not
+ * allocate at all.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/*
+ * Chunk header, followed by size bytes of memory, of which used are taken.
+ */
+struct arena_chunk {
+  struct arena_chunk *prev;   /* older chunk, NULL for the first one */
+  size_t size;
+  size_t used;
+};
+
+/* offset of the memory of a chunk behind its header */
+#define CHUNK_HEADER \
+  ((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/*
+ * Scratch arena of the calling thread. Threads which read and print
+ * directories each use their own, so no locking is needed.
+ */
+static _Thread_local struct arena scratch;
+
+/*
+ * Returns size bytes of a (at least one), aligned to ARENA_ALIGN, which stay
+ * valid until a is reset or released to a mark taken before.
+ * Returns NULL if there is not enough memory.
+ */
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+  struct arena_chunk *chunk;
+  void *p;
+
+  assert(a != NULL);
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (size == 0)
+    size = ARENA_ALIGN;
+  chunk = a->chunk;
+  if ((chunk == NULL) || ((chunk->size - chunk->used) < size)) {
+    size_t chunk_size;
+
+    /* large arrays get a chunk of their own */
+    chunk_size = (chunk == NULL) ? a->next_size : 0;
+    if (chunk_size < ARENA_CHUNK_SIZE)
+      chunk_size = ARENA_CHUNK_SIZE;
+    if (chunk_size < size)
+      chunk_size = size;
+    if (chunk_size > (SIZE_MAX - CHUNK_HEADER))
+      return NULL;
+    if ((chunk = (struct arena_chunk *)malloc(CHUNK_HEADER + chunk_size))
+      == NULL)
+      return NULL;
+    chunk->prev = a->chunk;
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    a->chunk = chunk;
+  }
+  p = (char *)chunk + CHUNK_HEADER + chunk->used;
+  chunk->used += size;
+  a->size += size;
+  if (a->size > a->peak)
+    a->peak = a->size;
+
+  return p;
+}
+
+/*
+ * Returns a copy of the old_size bytes at p with room for new_size bytes,
+ * like realloc(3). p stays allocated until the arena is reset.
+ * Returns NULL if there is not enough memory.
+ */
+void *
+arena_grow(struct arena *a, void *p, size_t old_size, size_t new_size)
+{
+  void *q;
+
+  assert((a != NULL) && ((p != NULL) || (old_size == 0))
+    && (old_size <= new_size));
+
+  if ((q = arena_alloc(a, new_size)) != NULL)
+    memcpy(q, p, old_size);
+
+  return q;
+}
+
+/*
+ * Like full_path in util.c, but takes exactly the memory needed for the
+ * path from a instead of PATH_MAX bytes.
+ */
+char *
+arena_path(struct arena *a, const char *dir, const char *name)
+{
+  size_t dir_length;
+  size_t name_length;
+  int slash;
+  char *path;
+
+  assert((a != NULL) && (dir != NULL) && (name != NULL));
+
+  dir_length = strlen(dir);
+  name_length = strlen(name);
+  if ((dir_length + NAME_MAX + 2) > PATH_MAX)
+    errx(EXIT_FAILURE, "path name %s too long", dir);
+  slash = (name_length > 0) && (dir_length > 0)
+    && (dir[dir_length - 1] != '/');
+  if ((path = (char *)arena_alloc(a, dir_length + slash + name_length + 1))
+    == NULL)
+    err(EXIT_FAILURE, "not enough memory for path name: dir(%s) name(%s)",
+      dir, name);
+  memcpy(path, dir, dir_length);
+  if (slash)
+    path[dir_length] = '/';
+  memcpy(path + dir_length + slash, name, name_length + 1);
+
+  return path;
+}
+
+/*
+ * Stores the current position of a in mark.
+ */
+void
+arena_mark(struct arena *a, struct arena_mark *mark)
+{
+  assert((a != NULL) && (mark != NULL));
+
+  mark->chunk = a->chunk;
+  mark->used = (a->chunk == NULL) ? 0 : a->chunk->used;
+  mark->size = a->size;
+}
+
+/*
+ * Frees everything allocated from a after mark was taken. The first chunk
+ * is kept for the next allocations.
+ */
+void
+arena_release(struct arena *a, const struct arena_mark *mark)
+{
+  assert((a != NULL) && (mark != NULL));
+
+  while ((a->chunk != mark->chunk) && (a->chunk->prev != NULL)) {
+    struct arena_chunk *prev = a->chunk->prev;
+
+    free(a->chunk);
+    a->chunk = prev;
+  }
+  if (a->chunk != NULL)
+    a->chunk->used = (a->chunk == mark->chunk) ? mark->used : 0;
+  a->size = mark->size;
+}
+
+/*
+ * Frees everything allocated from a. If that took several chunks, they are
+ * replaced by a single one with room for all of it on the next allocation.
+ */
+void
+arena_reset(struct arena *a)
+{
+  assert(a != NULL);
+
+  if ((a->chunk != NULL) && (a->chunk->prev != NULL)) {
+    a->next_size = a->peak;
+    arena_free(a);
+  } else if (a->chunk != NULL)
+    a->chunk->used = 0;
+  a->size = 0;
+  a->peak = 0;
+}
+
+/*
+ * Returns all memory of a to the system.
+ */
+void
+arena_free(struct arena *a)
+{
+  assert(a != NULL);
+
+  while (a->chunk != NULL) {
+    struct arena_chunk *prev = a->chunk->prev;
+
+    free(a->chunk);
+    a->chunk = prev;
+  }
+  a->size = 0;
+  a->peak = 0;
+}
+
+/*
+ * Returns the scratch arena of the calling thread, which holds the memory of
+ * the directory being read or printed. It is reset once the directory is
+ * printed, see list_one in ls.c and walk_worker and walk_print in walk.c.
+ * Code that may run several times for one directory releases its scratch
+ * memory to a mark itself.
+ */
+struct arena *
+arena_scratch(void)
+{
+  return &scratch;
+}
@@ -0,0 +1,42 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/* minimum size of each chunk of an arena */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+/* alignment of all allocations */
+#define ARENA_ALIGN 16
+
+struct arena_chunk;
+
+/*
+ * Bump allocator. Allocations are not freed one by one, but all at once by
+ * arena_reset, or back to a position taken with arena_mark.
+ */
+struct arena {
+  struct arena_chunk *chunk;   /* current chunk, NULL before the first use */
+  size_t size;        /* bytes allocated since the last reset */
+  size_t peak;        /* maximum of size since the last reset */
+  size_t next_size;   /* size of the next first chunk, see arena_reset */
+};
+
+/*
+ * Position in an arena, see arena_mark.
+ */
+struct arena_mark {
+  struct arena_chunk *chunk;
+  size_t used;
+  size_t size;
+};
+
+void *arena_alloc(struct arena *, size_t);
+void *arena_grow(struct arena *, void *, size_t, size_t);
+char *arena_path(struct arena *, const char *, const char *);
+void arena_mark(struct arena *, struct arena_mark *);
+void arena_release(struct arena *, const struct arena_mark *);
+void arena_reset(struct arena *);
+void arena_free(struct arena *);
+struct arena *arena_scratch(void);
+
+#endif /* !_ARENA_H_ */
@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Generates synthetic trees and times representative invocations of ls.
+# See the Benchmarks section in README.md for the variables.
+
+set -e
+
+LS=${LS:-./ls}
+BASELINE=${BASELINE:-}
+BENCH_DIR=${BENCH_DIR:-/tmp/ls-bench}
+BENCH_SCALE=${BENCH_SCALE:-1}
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_SYSCALLS=${BENCH_SYSCALLS:-1}
+BENCH_SHAPES=${BENCH_SHAPES:-"flat deep long owners symlinks"}
+BENCH_ARGS=${BENCH_ARGS:-"-1 -l -lR -lt -S -C"}
+BIN=$(dirname "$0")
+
+# creates the tree of a shape once; the options are scaled by BENCH_SCALE
+generate() {
+  shape=$1
+  dir=$BENCH_DIR/$shape
+  [ -d "$dir" ] && return
+  case $shape in
+  flat)     opts="-n $((200000 * BENCH_SCALE))" ;;
+  deep)     opts="-n $((20 * BENCH_SCALE)) -d 6 -w 4" ;;
+  long)     opts="-n $((50000 * BENCH_SCALE)) -l 200" ;;
+  owners)   opts="-n $((50000 * BENCH_SCALE)) -o 500" ;;
+  symlinks) opts="-n $((50000 * BENCH_SCALE)) -s 50" ;;
+  *)        echo "unknown shape $shape" >&2; exit 1 ;;
+  esac
+  mkdir -p "$BENCH_DIR"
+  start=$(date +%s)
+  # shellcheck disable=SC2086
+  "$BIN/gentree" $opts "$dir.tmp"
+  mv "$dir.tmp" "$dir"
+  echo "generated $shape ($opts) in $(($(date +%s) - start))s"
+}
+
+# prints wall time, peak RSS and system calls of one invocation
+measure() {
+  if [ "$BENCH_SYSCALLS" = 1 ]; then
+    COLUMNS=80 "$BIN/run" -c -r "$BENCH_RUNS" "$@"
+  else
+    COLUMNS=80 "$BIN/run" -r "$BENCH_RUNS" "$@"
+  fi
+}
+
+for shape in $BENCH_SHAPES; do
+  generate "$shape"
+done
+
+if [ -n "$BASELINE" ]; then
+  printf '%-9s %-4s %9s %9s %10s %9s %9s %10s %6s\n' shape args ms rss_kb \
+    syscalls base_ms base_rss base_sys speed
+else
+  printf '%-9s %-4s %9s %9s %10s\n' shape args ms rss_kb syscalls
+fi
+for shape in $BENCH_SHAPES; do
+  for args in $BENCH_ARGS; do
+    # shellcheck disable=SC2046
+    set -- $(measure "$LS" "$args" "$BENCH_DIR/$shape")
+    if [ -n "$BASELINE" ]; then
+      ms=$1 rss=$2 sys=$3
+      # shellcheck disable=SC2046
+      set -- $(measure "$BASELINE" "$args" "$BENCH_DIR/$shape")
+      printf '%-9s %-4s %9s %9s %10s %9s %9s %10s %6s\n' "$shape" "$args" \
+        "$ms" "$rss" "$sys" "$1" "$2" "$3" \
+        "$(awk "BEGIN { printf \"%.2fx\", ($1 + 1) / ($ms + 1) }")"
+    else
+      printf '%-9s %-4s %9s %9s %10s\n' "$shape" "$args" "$1" "$2" "$3"
+    fi
+  done
+done
@@ -0,0 +1,186 @@
+/*
+ * Generates synthetic directory trees for the benchmarks in bench.sh.
+ */
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* first uid and gid used for the owners */
+#define FIRST_OWNER 20000
+/* mtimes are spread over this many seconds before now */
+#define TIME_SPREAD (2 * 365 * 24 * 60 * 60)
+
+struct shape {
+  int files;      /* files per directory */
+  int depth;      /* levels of subdirectories */
+  int width;      /* subdirectories per directory */
+  int name_len;   /* minimum length of names */
+  int owners;     /* distinct owners, 0 to keep the current one */
+  int symlinks;   /* percentage of files which are symbolic links */
+};
+
+static uint64_t seed = 88172645463325252ULL;
+static time_t now;
+
+/*
+ * Returns the next pseudo-random number, so that trees are reproducible.
+ */
+static uint64_t
+next_random(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed;
+}
+
+/*
+ * Formats the name of the n-th entry with the given prefix into buf,
+ * padded to the length given by shape.
+ */
+static void
+make_name(char *buf, const char *prefix, int n, const struct shape *shape)
+{
+  int length;
+
+  length = snprintf(buf, NAME_MAX + 1, "%s%07d", prefix, n);
+  for (; (length < shape->name_len) && (length < NAME_MAX); length++)
+    buf[length] = 'a' + (length % 26);
+  buf[length] = 0;
+}
+
+/*
+ * Creates the files of one directory and then its subdirectories.
+ */
+static void
+fill(int dirfd, const struct shape *shape, int depth)
+{
+  char name[NAME_MAX + 1];
+  char target[NAME_MAX + 1];
+  int i;
+
+  /* symbolic links point to the first file, which is a regular one */
+  make_name(target, "f", 0, shape);
+  for (i = 0; i < shape->files; i++) {
+    struct timespec times[2];
+    int fd;
+
+    make_name(name, "f", i, shape);
+    if ((i > 0) && ((next_random() % 100) < (uint64_t)shape->symlinks)) {
+      if (symlinkat(target, dirfd, name) < 0)
+        err(EXIT_FAILURE, "symlink %s", name);
+    } else {
+      fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0)
+        err(EXIT_FAILURE, "create %s", name);
+      /* sparse files of different sizes for the S flag */
+      if (ftruncate(fd, next_random() % (1024 * 1024)) < 0)
+        err(EXIT_FAILURE, "truncate %s", name);
+      close(fd);
+    }
+    times[0].tv_sec = now - (next_random() % TIME_SPREAD);
+    times[0].tv_nsec = 0;
+    times[1] = times[0];
+    if (utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW) < 0)
+      err(EXIT_FAILURE, "utimensat %s", name);
+    if (shape->owners > 0) {
+      uid_t owner = FIRST_OWNER + (next_random() % shape->owners);
+
+      if (fchownat(dirfd, name, owner, owner, AT_SYMLINK_NOFOLLOW) < 0)
+        err(EXIT_FAILURE, "chown %s", name);
+    }
+  }
+
+  if (depth >= shape->depth)
+    return;
+  for (i = 0; i < shape->width; i++) {
+    int fd;
+
+    make_name(name, "d", i, shape);
+    if ((mkdirat(dirfd, name, 0755) < 0) && (errno != EEXIST))
+      err(EXIT_FAILURE, "mkdir %s", name);
+    if ((fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY)) < 0)
+      err(EXIT_FAILURE, "open %s", name);
+    fill(fd, shape, depth + 1);
+    close(fd);
+  }
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: gentree [-n files] [-d depth] [-w width] "
+    "[-l name_len] [-o owners] [-s symlink_percent] directory\n");
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Creates the directory given as the last argument and fills it with
+ * entries as determined by the options.
+ */
+int
+main(int argc, char *argv[])
+{
+  struct shape shape;
+  int ch;
+  int fd;
+
+  shape.files = 1000;
+  shape.depth = 0;
+  shape.width = 0;
+  shape.name_len = 0;
+  shape.owners = 0;
+  shape.symlinks = 0;
+
+  while ((ch = getopt(argc, argv, "d:l:n:o:s:w:")) != -1) {
+    switch (ch) {
+    case 'd':
+      shape.depth = atoi(optarg);
+      break;
+    case 'l':
+      shape.name_len = atoi(optarg);
+      break;
+    case 'n':
+      shape.files = atoi(optarg);
+      break;
+    case 'o':
+      shape.owners = atoi(optarg);
+      break;
+    case 's':
+      shape.symlinks = atoi(optarg);
+      break;
+    case 'w':
+      shape.width = atoi(optarg);
+      break;
+    default:
+      usage();
+      /* NOTREACHED */
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if (argc != 1)
+    usage();
+
+  now = time(NULL);
+  if ((mkdir(argv[0], 0755) < 0) && (errno != EEXIST))
+    err(EXIT_FAILURE, "mkdir %s", argv[0]);
+  if ((fd = open(argv[0], O_RDONLY | O_DIRECTORY)) < 0)
+    err(EXIT_FAILURE, "open %s", argv[0]);
+  fill(fd, &shape, 0);
+  close(fd);
+
+  return EXIT_SUCCESS;
+}
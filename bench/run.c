@@ -0,0 +1,166 @@
+/*
+ * Runs a command with its output discarded and reports the wall time, the
+ * peak resident set size and, with -c, the number of system calls of all
+ * of its threads.
+ */
+
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Starts the command with standard output redirected to /dev/null.
+ * If trace is set, the child stops before exec(3) for ptrace(2).
+ */
+static pid_t
+start(char *argv[], int trace)
+{
+  pid_t pid;
+
+  if ((pid = fork()) < 0)
+    err(EXIT_FAILURE, "fork");
+  if (pid == 0) {
+    int fd;
+
+    if ((fd = open("/dev/null", O_WRONLY)) < 0)
+      err(EXIT_FAILURE, "open /dev/null");
+    dup2(fd, STDOUT_FILENO);
+    if (trace) {
+      if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+        err(EXIT_FAILURE, "ptrace");
+      raise(SIGSTOP);
+    }
+    execvp(argv[0], argv);
+    err(EXIT_FAILURE, "exec %s", argv[0]);
+  }
+
+  return pid;
+}
+
+/*
+ * Returns the number of system calls the command makes, following all of
+ * its threads and children. Each call stops a tracee twice, on entry and
+ * on exit.
+ */
+static long
+count_syscalls(char *argv[])
+{
+  long stops;
+  pid_t pid;
+  int status;
+
+  pid = start(argv, 1);
+  if (waitpid(pid, &status, 0) < 0)
+    err(EXIT_FAILURE, "waitpid");
+  if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)(PTRACE_O_TRACESYSGOOD
+      | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK
+      | PTRACE_O_EXITKILL)) < 0)
+    err(EXIT_FAILURE, "ptrace options");
+  ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+  stops = 0;
+  for (;;) {
+    pid_t tid;
+    int sig;
+
+    if ((tid = waitpid(-1, &status, __WALL)) < 0)
+      break;
+    if (WIFEXITED(status) || WIFSIGNALED(status))
+      continue;
+    sig = 0;
+    if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+      stops++;
+    else if ((status >> 16) == 0) {
+      /* pass on real signals, but not the stop of a new thread */
+      sig = WSTOPSIG(status);
+      if ((sig == SIGSTOP) || (sig == SIGTRAP))
+        sig = 0;
+    }
+    ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+  }
+
+  return (stops + 1) / 2;
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: run [-c] [-r runs] command [argument ...]\n");
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Prints the fastest wall time in milliseconds of all runs, the peak
+ * resident set size in KiB and the number of system calls or "-".
+ */
+int
+main(int argc, char *argv[])
+{
+  long best_ms;
+  long max_rss;
+  int syscalls;
+  int runs;
+  int ch;
+  int i;
+
+  syscalls = 0;
+  runs = 1;
+  while ((ch = getopt(argc, argv, "+cr:")) != -1) {
+    switch (ch) {
+    case 'c':
+      syscalls = 1;
+      break;
+    case 'r':
+      runs = atoi(optarg);
+      break;
+    default:
+      usage();
+      /* NOTREACHED */
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if ((argc < 1) || (runs < 1))
+    usage();
+
+  best_ms = -1;
+  max_rss = 0;
+  for (i = 0; i < runs; i++) {
+    struct timespec t0;
+    struct timespec t1;
+    struct rusage usage;
+    long ms;
+    int status;
+    pid_t pid;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid = start(argv, 0);
+    if (wait4(pid, &status, 0, &usage) < 0)
+      err(EXIT_FAILURE, "wait4");
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+      errx(EXIT_FAILURE, "%s failed", argv[0]);
+    ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+    if ((best_ms < 0) || (ms < best_ms))
+      best_ms = ms;
+    if (usage.ru_maxrss > max_rss)
+      max_rss = usage.ru_maxrss;
+  }
+
+  if (syscalls)
+    printf("%ld %ld %ld\n", best_ms, max_rss, count_syscalls(argv));
+  else
+    printf("%ld %ld -\n", best_ms, max_rss);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,328 @@
+/*
+ * Persistent cache of directory listings, enabled by LS_CACHE.
+ * Each directory is kept in its own file below the cache directory, named
+ * after the device and inode of the directory. A file is valid as long as
+ * the modification and change times of the directory itself are those
+ * recorded in it. Files are written to a temporary name and renamed into
+ * place, so that concurrent readers, which map them, always see complete
+ * files and concurrent writers do not interfere.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "entries.h"
+#include "util.h"
+
+/* the entries carry all fields of the header's mask */
+#define CACHE_STATS 0x1
+/* the modes of regular files are complete, as needed by the F flag */
+#define CACHE_MODES 0x2
+/* hidden files are included (a flag) */
+#define CACHE_HIDDEN 0x4
+
+struct cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t layout;      /* sizes of the stored types */
+  uint32_t fields;      /* STATX_* mask of the stored arrays */
+  uint32_t flags;       /* CACHE_* */
+  uint64_t count;
+  uint64_t names_len;
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t ctime_sec;
+  int64_t ctime_nsec;
+};
+
+/*
+ * The optional arrays of an entry_list, stored in this order after the
+ * names and modes.
+ */
+static const struct {
+  unsigned int mask;
+  size_t offset;
+  size_t size;
+} cache_fields[] = {
+  { STATX_INO, offsetof(struct entry_list, ino), sizeof(ino_t) },
+  { STATX_NLINK, offsetof(struct entry_list, nlink), sizeof(nlink_t) },
+  { STATX_UID, offsetof(struct entry_list, uid), sizeof(uid_t) },
+  { STATX_GID, offsetof(struct entry_list, gid), sizeof(gid_t) },
+  { STATX_SIZE, offsetof(struct entry_list, size), sizeof(off_t) },
+  { STATX_SIZE, offsetof(struct entry_list, rdev), sizeof(dev_t) },
+  { STATX_BLOCKS, offsetof(struct entry_list, blocks), sizeof(blkcnt_t) },
+  { STATX_ATIME, offsetof(struct entry_list, atime),
+    sizeof(struct timespec) },
+  { STATX_MTIME, offsetof(struct entry_list, mtime),
+    sizeof(struct timespec) },
+  { STATX_CTIME, offsetof(struct entry_list, ctime), sizeof(struct timespec) }
+};
+
+#define CACHE_FIELDS (sizeof(cache_fields) / sizeof(cache_fields[0]))
+#define FIELD(list, f) (*(char **)((char *)(list) + cache_fields[(f)].offset))
+
+/* identifies the sizes of the stored types, so foreign files are ignored */
+#define CACHE_LAYOUT ((uint32_t)((sizeof(mode_t) << 24) \
+  | (sizeof(off_t) << 16) | (sizeof(struct timespec) << 8) \
+  | sizeof(size_t)))
+
+/*
+ * Stores the path of the cache file of the directory sb in path.
+ * Returns 0 on success and -1, if the path is too long.
+ */
+static int
+cache_path(struct flags *flag, const struct stat *sb, char *path)
+{
+  int length;
+
+  length = snprintf(path, PATH_MAX, "%s/%016llx-%016llx", flag->cache_dir,
+    (unsigned long long)sb->st_dev, (unsigned long long)sb->st_ino);
+  return ((length < 0) || (length >= PATH_MAX)) ? -1 : 0;
+}
+
+/*
+ * Returns the CACHE_* flags which the entries of a live read with the given
+ * flags have.
+ */
+static uint32_t
+cache_flags(struct flags *flag)
+{
+  uint32_t flags;
+
+  flags = 0;
+  if (needs_stat(flag))
+    flags |= CACHE_STATS | CACHE_MODES;
+  if (flag->Fflag)
+    flags |= CACHE_MODES;
+  if (flag->aflag)
+    flags |= CACHE_HIDDEN;
+
+  return flags;
+}
+
+/*
+ * Fills the empty list, initialized with the fields of req, with the
+ * cached entries of the directory sb, if they are usable for flag.
+ * Returns 0 on success and -1, if the directory has to be read.
+ */
+int
+cache_load(struct flags *flag, const struct stat *sb,
+  struct entry_list *list, const struct stat_request *req)
+{
+  char path[PATH_MAX];
+  const struct cache_header *header;
+  const char *data;
+  const char *names;
+  const char *pos;
+  struct stat cache_sb;
+  uint32_t wanted;
+  uint32_t fields;
+  uint64_t rest;
+  size_t f;
+  size_t i;
+  int fd;
+  int res;
+
+  assert((flag != NULL) && (sb != NULL) && (list != NULL) && (req != NULL));
+
+  if (cache_path(flag, sb, path) < 0)
+    return -1;
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return -1;
+  if ((fstat(fd, &cache_sb) < 0)
+    || (cache_sb.st_size < (off_t)sizeof(struct cache_header))) {
+    close(fd);
+    return -1;
+  }
+  data = (const char *)mmap(NULL, cache_sb.st_size, PROT_READ, MAP_PRIVATE,
+    fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return -1;
+
+  res = -1;
+  header = (const struct cache_header *)data;
+  wanted = cache_flags(flag);
+  fields = (wanted & CACHE_STATS) ? (req->mask & ~(STATX_TYPE | STATX_MODE))
+    : 0;
+  if ((memcmp(header->magic, "LSCACHE", 8) != 0)
+    || (header->version != CACHE_VERSION) || (header->layout != CACHE_LAYOUT)
+    || (header->dev != (uint64_t)sb->st_dev)
+    || (header->ino != (uint64_t)sb->st_ino)
+    || (header->mtime_sec != sb->st_mtim.tv_sec)
+    || (header->mtime_nsec != sb->st_mtim.tv_nsec)
+    || (header->ctime_sec != sb->st_ctim.tv_sec)
+    || (header->ctime_nsec != sb->st_ctim.tv_nsec)
+    /* the cached entries must include what the flags need */
+    || ((header->flags & CACHE_HIDDEN) != (wanted & CACHE_HIDDEN))
+    || ((header->flags & wanted) != wanted)
+    || ((header->fields & fields) != fields))
+    goto done;
+
+  /*
+   * Check the size before touching the arrays, taking every part off the
+   * rest of the file, so that no product or sum can overflow.
+   */
+  rest = cache_sb.st_size - sizeof(struct cache_header);
+  if ((header->count > INT32_MAX) || (header->names_len > rest))
+    goto done;
+  rest -= header->names_len;
+  if (header->count > (rest / sizeof(mode_t)))
+    goto done;
+  rest -= header->count * sizeof(mode_t);
+  for (f = 0; f < CACHE_FIELDS; f++) {
+    if (!(header->fields & cache_fields[f].mask))
+      continue;
+    if (header->count > (rest / cache_fields[f].size))
+      goto done;
+    rest -= header->count * cache_fields[f].size;
+  }
+  if (rest != 0)
+    goto done;
+
+  names = data + sizeof(struct cache_header);
+  pos = names;
+  for (i = 0; i < header->count; i++) {
+    const char *end = memchr(pos, 0, names + header->names_len - pos);
+
+    if ((end == NULL) || (entries_add(list, pos, 0, 0) < 0))
+      goto done;
+    pos = end + 1;
+  }
+  pos = names + header->names_len;
+  memcpy(list->mode, pos, header->count * sizeof(mode_t));
+  pos += header->count * sizeof(mode_t);
+  for (f = 0; f < CACHE_FIELDS; f++) {
+    size_t length;
+
+    if (!(header->fields & cache_fields[f].mask))
+      continue;
+    length = header->count * cache_fields[f].size;
+    if (FIELD(list, f) != NULL)
+      memcpy(FIELD(list, f), pos, length);
+    pos += length;
+  }
+  res = 0;
+
+done:
+  munmap((void *)data, cache_sb.st_size);
+  if (res < 0)
+    entries_clear(list);
+
+  return res;
+}
+
+/*
+ * Writes all of buf to fd. Returns 0 on success and -1 on failure.
+ */
+static int
+write_full(int fd, const void *buf, size_t length)
+{
+  const char *p;
+
+  p = (const char *)buf;
+  while (length > 0) {
+    ssize_t written;
+
+    if ((written = write(fd, p, length)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += written;
+    length -= written;
+  }
+
+  return 0;
+}
+
+/*
+ * Stores the entries of a live read of the directory sb, which was
+ * stat(2)ed before it was read, with the fields of req. The cache is best
+ * effort, so failures are ignored.
+ * A directory changed less than CACHE_RACY seconds before is not stored:
+ * a later change within the same tick of its timestamps would leave them
+ * as they are, and the stale entries would be trusted for good.
+ */
+void
+cache_store(struct flags *flag, const struct stat *sb,
+  const struct entry_list *list, const struct stat_request *req)
+{
+  char path[PATH_MAX];
+  char tmp[PATH_MAX];
+  struct cache_header header;
+  struct timespec now;
+  size_t count;
+  size_t f;
+  int fd;
+  int i;
+
+  assert((flag != NULL) && (sb != NULL) && (list != NULL) && (req != NULL));
+
+  if ((clock_gettime(CLOCK_REALTIME, &now) < 0)
+    || ((now.tv_sec - sb->st_ctim.tv_sec) <= CACHE_RACY))
+    return;
+  if ((cache_path(flag, sb, path) < 0)
+    || (snprintf(tmp, sizeof(tmp), "%s/.tmp.XXXXXX", flag->cache_dir)
+      >= (int)sizeof(tmp)))
+    return;
+  if ((fd = mkostemp(tmp, O_CLOEXEC)) < 0)
+    return;
+
+  count = list->count;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "LSCACHE", 8);
+  header.version = CACHE_VERSION;
+  header.layout = CACHE_LAYOUT;
+  header.flags = cache_flags(flag);
+  header.fields = (header.flags & CACHE_STATS)
+    ? (req->mask & ~(STATX_TYPE | STATX_MODE)) : 0;
+  header.count = count;
+  header.names_len = list->names_len;
+  header.dev = sb->st_dev;
+  header.ino = sb->st_ino;
+  header.mtime_sec = sb->st_mtim.tv_sec;
+  header.mtime_nsec = sb->st_mtim.tv_nsec;
+  header.ctime_sec = sb->st_ctim.tv_sec;
+  header.ctime_nsec = sb->st_ctim.tv_nsec;
+
+  /* entries_add packs the names in index order */
+  if ((write_full(fd, &header, sizeof(header)) < 0)
+    || (write_full(fd, list->names, list->names_len) < 0)
+    || (write_full(fd, list->mode, count * sizeof(mode_t)) < 0))
+    goto fail;
+  for (f = 0; f < CACHE_FIELDS; f++) {
+    if ((header.fields & cache_fields[f].mask)
+      && (write_full(fd, FIELD(list, f), count * cache_fields[f].size) < 0))
+      goto fail;
+  }
+  i = close(fd);
+  fd = -1;
+  if ((i < 0) || (rename(tmp, path) < 0))
+    goto fail;
+
+  return;
+
+fail:
+  if (fd >= 0)
+    close(fd);
+  unlink(tmp);
+}
@@ -0,0 +1,19 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <sys/stat.h>
+
+#include "entries.h"
+#include "util.h"
+
+/* format of the cache files, increased on incompatible changes */
+#define CACHE_VERSION 1
+/* seconds after its last change during which a directory is not stored */
+#define CACHE_RACY 1
+
+int cache_load(struct flags *, const struct stat *, struct entry_list *,
+  const struct stat_request *);
+void cache_store(struct flags *, const struct stat *,
+  const struct entry_list *, const struct stat_request *);
+
+#endif /* !_CACHE_H_ */
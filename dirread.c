@@ -0,0 +1,147 @@
+/*
+ * Single-pass directory reader on top of getdents64(2).
+ * Functions return -1 and set errno on failure, so that callers can decide
+ * how to report the error.
+ */
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "dirread.h"
+#include "stats.h"
+
+/*
+ * Record layout returned by getdents64(2).
+ */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/*
+ * Opens the given directory for reading.
+ * Returns 0 on success and -1 on failure.
+ */
+int
+dir_open(struct dir_reader *dir, const char *path)
+{
+  assert((dir != NULL) && (path != NULL));
+
+  dir->len = 0;
+  dir->pos = 0;
+  dir->eof = 0;
+  if ((dir->buf = (char *)malloc(DIRREAD_BUF_SIZE)) == NULL)
+    return -1;
+  STATS_COUNT(STATS_OPEN, 1);
+  if ((dir->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    int saved_errno = errno;
+
+    free(dir->buf);
+    dir->buf = NULL;
+    errno = saved_errno;
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Stores the next directory entry in rec. rec->name stays valid until the
+ * next call to dir_next() or dir_close().
+ * Returns 1 if an entry was read, 0 at the end of the directory and -1 on
+ * failure.
+ */
+int
+dir_next(struct dir_reader *dir, struct dir_record *rec)
+{
+  struct linux_dirent64 *d;
+
+  assert((dir != NULL) && (rec != NULL));
+
+  if (dir->pos >= dir->len) {
+    long n;
+
+    if (dir->eof)
+      return 0;
+    /* fetch the next batch of entries */
+    STATS_COUNT(STATS_GETDENTS, 1);
+    n = syscall(SYS_getdents64, dir->fd, dir->buf, DIRREAD_BUF_SIZE);
+    if (n < 0)
+      return -1;
+    if (n == 0) {
+      dir->eof = 1;
+      return 0;
+    }
+    dir->len = n;
+    dir->pos = 0;
+  }
+
+  d = (struct linux_dirent64 *)(dir->buf + dir->pos);
+  dir->pos += d->d_reclen;
+  rec->name = d->d_name;
+  rec->ino = d->d_ino;
+  rec->type = d->d_type;
+
+  return 1;
+}
+
+/*
+ * Returns whether records of the last getdents64(2) batch are still to be
+ * returned by dir_next, so that callers may process records batch by batch.
+ */
+int
+dir_buffered(const struct dir_reader *dir)
+{
+  assert(dir != NULL);
+  return dir->pos < dir->len;
+}
+
+/*
+ * Releases the read buffer but keeps the directory open, so that its
+ * entries can still be accessed relative to the returned descriptor.
+ * The caller is responsible for close(2)ing it.
+ */
+int
+dir_detach(struct dir_reader *dir)
+{
+  int fd;
+
+  assert(dir != NULL);
+
+  free(dir->buf);
+  dir->buf = NULL;
+  fd = dir->fd;
+  dir->fd = -1;
+
+  return fd;
+}
+
+/*
+ * Closes the directory and releases the read buffer.
+ * Returns 0 on success and -1 on failure.
+ */
+int
+dir_close(struct dir_reader *dir)
+{
+  int r;
+
+  assert(dir != NULL);
+
+  free(dir->buf);
+  dir->buf = NULL;
+  r = close(dir->fd);
+  dir->fd = -1;
+
+  return r;
+}
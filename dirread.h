@@ -0,0 +1,34 @@
+#ifndef _DIRREAD_H_
+#define _DIRREAD_H_
+
+#include <sys/types.h>
+
+#include <stddef.h>
+
+/*
+ * Size of the buffer handed to getdents64(2). Large batches keep the number
+ * of round trips low on network file systems.
+ */
+#define DIRREAD_BUF_SIZE (256 * 1024)
+
+struct dir_reader {
+  int fd;
+  char *buf;
+  size_t len;
+  size_t pos;
+  int eof;
+};
+
+struct dir_record {
+  const char *name;
+  ino_t ino;
+  unsigned char type;
+};
+
+int dir_open(struct dir_reader *, const char *);
+int dir_next(struct dir_reader *, struct dir_record *);
+int dir_buffered(const struct dir_reader *);
+int dir_detach(struct dir_reader *);
+int dir_close(struct dir_reader *);
+
+#endif /* !_DIRREAD_H_ */
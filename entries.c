@@ -0,0 +1,352 @@
+/*
+ * Compact storage for directory entries. See entries.h.
+ * Functions return -1 and set errno on failure.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "entries.h"
+
+/* initial number of entries and name bytes */
+#define ENTRIES_INIT_COUNT 64
+#define ENTRIES_INIT_NAMES 1024
+
+/*
+ * Resizes the array *p to hold size elements of elem_size bytes each.
+ * Leaves *p alone if it is NULL, i.e. the field was not requested.
+ * Returns 0 on success and -1 on failure.
+ */
+static int
+grow_field(void *p, size_t elem_size, int size)
+{
+  void **field;
+  void *ptr;
+
+  field = (void **)p;
+  if (*field == NULL)
+    return 0;
+  if ((ptr = realloc(*field, elem_size * size)) == NULL)
+    return -1;
+  *field = ptr;
+
+  return 0;
+}
+
+/*
+ * Resizes all allocated arrays of list to hold size entries.
+ * Returns 0 on success and -1 on failure.
+ */
+static int
+grow(struct entry_list *list, int size)
+{
+  if ((grow_field(&list->name_off, sizeof(size_t), size) < 0)
+    || (grow_field(&list->order, sizeof(uint32_t), size) < 0)
+    || (grow_field(&list->mode, sizeof(mode_t), size) < 0)
+    || (grow_field(&list->ino, sizeof(ino_t), size) < 0)
+    || (grow_field(&list->nlink, sizeof(nlink_t), size) < 0)
+    || (grow_field(&list->uid, sizeof(uid_t), size) < 0)
+    || (grow_field(&list->gid, sizeof(gid_t), size) < 0)
+    || (grow_field(&list->size, sizeof(off_t), size) < 0)
+    || (grow_field(&list->rdev, sizeof(dev_t), size) < 0)
+    || (grow_field(&list->blocks, sizeof(blkcnt_t), size) < 0)
+    || (grow_field(&list->atime, sizeof(struct timespec), size) < 0)
+    || (grow_field(&list->mtime, sizeof(struct timespec), size) < 0)
+    || (grow_field(&list->ctime, sizeof(struct timespec), size) < 0))
+    return -1;
+  list->capacity = size;
+
+  return 0;
+}
+
+/*
+ * Allocates a one-element array, so that grow resizes it later.
+ */
+static void *
+field_alloc(int wanted, size_t elem_size)
+{
+  return wanted ? malloc(elem_size) : NULL;
+}
+
+/*
+ * Initializes an empty list which stores the given statx(2) fields.
+ * The file type and mode are always stored.
+ */
+void
+entries_init(struct entry_list *list, unsigned int fields)
+{
+  assert(list != NULL);
+
+  memset(list, 0, sizeof(*list));
+  list->fields = fields;
+  list->name_off = (size_t *)field_alloc(1, sizeof(size_t));
+  list->order = (uint32_t *)field_alloc(1, sizeof(uint32_t));
+  list->mode = (mode_t *)field_alloc(1, sizeof(mode_t));
+  list->ino = (ino_t *)field_alloc(fields & STATX_INO, sizeof(ino_t));
+  list->nlink = (nlink_t *)field_alloc(fields & STATX_NLINK, sizeof(nlink_t));
+  list->uid = (uid_t *)field_alloc(fields & STATX_UID, sizeof(uid_t));
+  list->gid = (gid_t *)field_alloc(fields & STATX_GID, sizeof(gid_t));
+  list->size = (off_t *)field_alloc(fields & STATX_SIZE, sizeof(off_t));
+  /* device numbers are displayed in place of the size */
+  list->rdev = (dev_t *)field_alloc(fields & STATX_SIZE, sizeof(dev_t));
+  list->blocks = (blkcnt_t *)field_alloc(fields & STATX_BLOCKS,
+    sizeof(blkcnt_t));
+  list->atime = (struct timespec *)field_alloc(fields & STATX_ATIME,
+    sizeof(struct timespec));
+  list->mtime = (struct timespec *)field_alloc(fields & STATX_MTIME,
+    sizeof(struct timespec));
+  list->ctime = (struct timespec *)field_alloc(fields & STATX_CTIME,
+    sizeof(struct timespec));
+  list->capacity = 1;
+}
+
+/*
+ * Appends an entry with the given name, file type and inode number. The
+ * other fields are zero until entry_set_stat is called. The entry is
+ * appended to the display order as well.
+ * Returns the index of the new entry on success and -1 on failure.
+ */
+int
+entries_add(struct entry_list *list, const char *name, mode_t mode,
+  ino_t ino)
+{
+  size_t length;
+  struct stat sb;
+  int i;
+
+  assert((list != NULL) && (name != NULL));
+
+  if ((list->name_off == NULL) || (list->order == NULL)
+    || (list->mode == NULL)) {
+    errno = ENOMEM;
+    return -1;
+  }
+  if ((list->count == list->capacity)
+    && (grow(list, (list->capacity < ENTRIES_INIT_COUNT)
+      ? ENTRIES_INIT_COUNT : (list->capacity * 2)) < 0))
+    return -1;
+
+  length = strlen(name) + 1;
+  if ((list->names_len + length) > list->names_size) {
+    size_t size;
+    char *names;
+
+    size = (list->names_size == 0) ? ENTRIES_INIT_NAMES : list->names_size;
+    while ((list->names_len + length) > size)
+      size *= 2;
+    if ((names = (char *)realloc(list->names, size)) == NULL)
+      return -1;
+    list->names = names;
+    list->names_size = size;
+  }
+
+  i = list->count++;
+  memcpy(list->names + list->names_len, name, length);
+  list->name_off[i] = list->names_len;
+  list->names_len += length;
+  list->order[i] = i;
+
+  memset(&sb, 0, sizeof(sb));
+  sb.st_mode = mode;
+  sb.st_ino = ino;
+  entry_set_stat(list, i, &sb);
+
+  return i;
+}
+
+/*
+ * Stores the allocated fields of sb in the entry with index i.
+ */
+void
+entry_set_stat(struct entry_list *list, int i, const struct stat *sb)
+{
+  assert((list != NULL) && (i >= 0) && (i < list->count) && (sb != NULL));
+
+  list->mode[i] = sb->st_mode;
+  if (list->ino != NULL)
+    list->ino[i] = sb->st_ino;
+  if (list->nlink != NULL)
+    list->nlink[i] = sb->st_nlink;
+  if (list->uid != NULL)
+    list->uid[i] = sb->st_uid;
+  if (list->gid != NULL)
+    list->gid[i] = sb->st_gid;
+  if (list->size != NULL) {
+    list->size[i] = sb->st_size;
+    list->rdev[i] = sb->st_rdev;
+  }
+  if (list->blocks != NULL)
+    list->blocks[i] = sb->st_blocks;
+  if (list->atime != NULL)
+    list->atime[i] = sb->st_atim;
+  if (list->mtime != NULL)
+    list->mtime[i] = sb->st_mtim;
+  if (list->ctime != NULL)
+    list->ctime[i] = sb->st_ctim;
+}
+
+/*
+ * Fills sb with the stored fields of the entry with index i. Fields which
+ * are not stored are zero.
+ */
+void
+entry_stat(const struct entry_list *list, int i, struct stat *sb)
+{
+  assert((list != NULL) && (i >= 0) && (i < list->count) && (sb != NULL));
+
+  memset(sb, 0, sizeof(*sb));
+  sb->st_mode = list->mode[i];
+  if (list->ino != NULL)
+    sb->st_ino = list->ino[i];
+  if (list->nlink != NULL)
+    sb->st_nlink = list->nlink[i];
+  if (list->uid != NULL)
+    sb->st_uid = list->uid[i];
+  if (list->gid != NULL)
+    sb->st_gid = list->gid[i];
+  if (list->size != NULL) {
+    sb->st_size = list->size[i];
+    sb->st_rdev = list->rdev[i];
+  }
+  if (list->blocks != NULL)
+    sb->st_blocks = list->blocks[i];
+  if (list->atime != NULL)
+    sb->st_atim = list->atime[i];
+  if (list->mtime != NULL)
+    sb->st_mtim = list->mtime[i];
+  if (list->ctime != NULL)
+    sb->st_ctim = list->ctime[i];
+}
+
+/*
+ * Removes the entry with index i by moving the last entry to index i. The
+ * name of the removed entry stays in the arena until the list is cleared.
+ * Updating the display order is left to the caller.
+ */
+void
+entries_remove(struct entry_list *list, int i)
+{
+  struct stat sb;
+  int last;
+
+  assert((list != NULL) && (i >= 0) && (i < list->count));
+
+  last = list->count - 1;
+  if (i != last) {
+    entry_stat(list, last, &sb);
+    entry_set_stat(list, i, &sb);
+    list->name_off[i] = list->name_off[last];
+  }
+  list->count--;
+}
+
+/*
+ * Keeps only the entries order[0] to order[n - 1], which become the
+ * entries 0 to n - 1 in that order, and frees the memory of the others.
+ * Returns 0 on success. Otherwise, returns -1 and leaves the list as it
+ * was.
+ */
+int
+entries_keep(struct entry_list *list, int n)
+{
+  struct entry_list kept;
+  struct stat sb;
+  int i;
+
+  assert((list != NULL) && (n >= 0) && (n <= list->count));
+
+  entries_init(&kept, list->fields);
+  for (i = 0; i < n; i++) {
+    uint32_t index = list->order[i];
+    int k;
+
+    if ((k = entries_add(&kept, ENTRY_NAME(list, index), list->mode[index],
+      0)) < 0) {
+      entries_free(&kept);
+      return -1;
+    }
+    entry_stat(list, index, &sb);
+    entry_set_stat(&kept, k, &sb);
+  }
+  entries_free(list);
+  *list = kept;
+
+  return 0;
+}
+
+/*
+ * Removes all entries from the list, keeping its memory for new entries.
+ */
+void
+entries_clear(struct entry_list *list)
+{
+  assert(list != NULL);
+
+  list->count = 0;
+  list->names_len = 0;
+}
+
+/*
+ * Returns the number of bytes allocated for the entries of list.
+ */
+size_t
+entries_memory(const struct entry_list *list)
+{
+  size_t entry_size;
+
+  assert(list != NULL);
+
+  entry_size = sizeof(size_t) + sizeof(uint32_t) + sizeof(mode_t);
+  if (list->ino != NULL)
+    entry_size += sizeof(ino_t);
+  if (list->nlink != NULL)
+    entry_size += sizeof(nlink_t);
+  if (list->uid != NULL)
+    entry_size += sizeof(uid_t);
+  if (list->gid != NULL)
+    entry_size += sizeof(gid_t);
+  if (list->size != NULL)
+    entry_size += sizeof(off_t) + sizeof(dev_t);
+  if (list->blocks != NULL)
+    entry_size += sizeof(blkcnt_t);
+  if (list->atime != NULL)
+    entry_size += sizeof(struct timespec);
+  if (list->mtime != NULL)
+    entry_size += sizeof(struct timespec);
+  if (list->ctime != NULL)
+    entry_size += sizeof(struct timespec);
+
+  return list->names_size + entry_size * list->capacity;
+}
+
+/*
+ * Frees all memory of the list.
+ */
+void
+entries_free(struct entry_list *list)
+{
+  assert(list != NULL);
+
+  free(list->names);
+  free(list->name_off);
+  free(list->order);
+  free(list->mode);
+  free(list->ino);
+  free(list->nlink);
+  free(list->uid);
+  free(list->gid);
+  free(list->size);
+  free(list->rdev);
+  free(list->blocks);
+  free(list->atime);
+  free(list->mtime);
+  free(list->ctime);
+  memset(list, 0, sizeof(*list));
+}
@@ -0,0 +1,53 @@
+#ifndef _ENTRIES_H_
+#define _ENTRIES_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Entries of a directory or of the command line.
+ * Names are packed back to back into one arena. Metadata is kept in dense
+ * per-field arrays, which are only allocated for the statx(2) fields given
+ * to entries_init. Sorting permutes order, which maps display positions to
+ * entry indices, and is the only thing consumers iterate over.
+ */
+struct entry_list {
+  int count;
+  int capacity;
+  unsigned int fields;    /* STATX_* mask of the allocated arrays */
+  char *names;
+  size_t names_len;
+  size_t names_size;
+  size_t *name_off;       /* offset of each name in names */
+  uint32_t *order;
+  mode_t *mode;           /* always allocated */
+  ino_t *ino;
+  nlink_t *nlink;
+  uid_t *uid;
+  gid_t *gid;
+  off_t *size;
+  dev_t *rdev;            /* allocated along with size */
+  blkcnt_t *blocks;
+  struct timespec *atime;
+  struct timespec *mtime;
+  struct timespec *ctime;
+};
+
+/* name of the entry with index i */
+#define ENTRY_NAME(list, i) ((list)->names + (list)->name_off[(i)])
+
+void entries_init(struct entry_list *, unsigned int);
+int entries_add(struct entry_list *, const char *, mode_t, ino_t);
+void entry_set_stat(struct entry_list *, int, const struct stat *);
+void entry_stat(const struct entry_list *, int, struct stat *);
+void entries_remove(struct entry_list *, int);
+int entries_keep(struct entry_list *, int);
+void entries_clear(struct entry_list *);
+size_t entries_memory(const struct entry_list *);
+void entries_free(struct entry_list *);
+
+#endif /* !_ENTRIES_H_ */
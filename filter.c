@@ -0,0 +1,113 @@
+/*
+ * Name filters of the I and X flags. They are applied to directory entries
+ * as they are read, so that filtered entries are never stat(2)ed, sorted or
+ * printed.
+ * Patterns without wildcards and patterns like *.log, the common cases,
+ * are compared with memcmp(3); only the others go through fnmatch(3).
+ */
+
+#include <assert.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+/* characters which make a pattern more than a literal for fnmatch(3) */
+#define FILTER_WILDCARDS "*?[\\"
+
+/*
+ * Initializes f without patterns, which lets every name pass.
+ */
+void
+filters_init(struct filters *f)
+{
+  assert(f != NULL);
+  f->v = NULL;
+  f->count = 0;
+  f->includes = 0;
+}
+
+/*
+ * Appends pattern, which has to stay valid as long as f is used, to the
+ * include patterns of f or, if exclude is set, to its exclude patterns.
+ * Returns 0 on success and -1 on failure.
+ */
+int
+filters_add(struct filters *f, const char *pattern, int exclude)
+{
+  struct filter *v;
+  struct filter *p;
+
+  assert((f != NULL) && (pattern != NULL));
+
+  if ((v = (struct filter *)realloc(f->v, sizeof(struct filter)
+    * (f->count + 1))) == NULL)
+    return -1;
+  f->v = v;
+  p = &f->v[f->count++];
+  p->exclude = exclude;
+  if (!exclude)
+    f->includes++;
+
+  if (strpbrk(pattern, FILTER_WILDCARDS) == NULL)
+    p->kind = FILTER_EXACT;
+  else if ((pattern[0] == '*')
+    && (strpbrk(pattern + 1, FILTER_WILDCARDS) == NULL)) {
+    p->kind = FILTER_SUFFIX;
+    pattern++;
+  } else
+    p->kind = FILTER_GLOB;
+  p->pattern = pattern;
+  p->len = strlen(pattern);
+
+  return 0;
+}
+
+/*
+ * Returns whether name, of the given length, matches p.
+ */
+static int
+filter_match(const struct filter *p, const char *name, size_t len)
+{
+  switch (p->kind) {
+  case FILTER_EXACT:
+    return (len == p->len) && (memcmp(name, p->pattern, len) == 0);
+  case FILTER_SUFFIX:
+    return (len >= p->len)
+      && (memcmp(name + len - p->len, p->pattern, p->len) == 0);
+  default:
+    return fnmatch(p->pattern, name, 0) == 0;
+  }
+}
+
+/*
+ * Returns whether the entry name is to be listed: it matches no exclude
+ * pattern and, if there are include patterns, one of them. If dir is set,
+ * the entry is a directory which is to be descended into and is only
+ * subject to the exclude patterns.
+ */
+int
+filters_match(const struct filters *f, const char *name, int dir)
+{
+  size_t len;
+  int included;
+  int i;
+
+  assert((f != NULL) && (name != NULL));
+
+  if (f->count == 0)
+    return 1;
+  len = strlen(name);
+  included = dir || (f->includes == 0);
+  for (i = 0; i < f->count; i++) {
+    if ((f->v[i].exclude || !included)
+      && filter_match(&f->v[i], name, len)) {
+      if (f->v[i].exclude)
+        return 0;
+      included = 1;
+    }
+  }
+
+  return included;
+}
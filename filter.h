@@ -0,0 +1,35 @@
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <stddef.h>
+
+/*
+ * How a pattern is matched, chosen once by filters_add.
+ */
+enum filter_kind {
+  FILTER_EXACT,   /* no wildcards, compared as a whole */
+  FILTER_SUFFIX,  /* '*' followed by no wildcards, e.g. *.log */
+  FILTER_GLOB     /* anything else, see fnmatch(3) */
+};
+
+struct filter {
+  const char *pattern;  /* without the leading '*' for FILTER_SUFFIX */
+  size_t len;           /* of pattern */
+  enum filter_kind kind;
+  int exclude;          /* X flag rather than I flag */
+};
+
+/*
+ * Name patterns of the I and X flags, in the order of the command line.
+ */
+struct filters {
+  struct filter *v;
+  int count;
+  int includes;   /* number of I patterns */
+};
+
+void filters_init(struct filters *);
+int filters_add(struct filters *, const char *, int);
+int filters_match(const struct filters *, const char *, int);
+
+#endif /* !_FILTER_H_ */
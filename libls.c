@@ -0,0 +1,211 @@
+/*
+ * Library interface for listing directories within a process, see libls.h
+ * and the Library section of README.md. A directory is read, stat(2)ed and
+ * sorted by statdir and sort_entries when it is opened, exactly as ls does,
+ * and then iterated in the order of the listing.
+ * Handles are independent, so threads may list different directories at
+ * the same time. The user and group names and the time zone offsets are
+ * cached for the whole process, so later calls do not look them up again;
+ * formatting is serialized, since these caches are shared.
+ * Functions return -1 or NULL and set errno on failure instead of
+ * terminating the process.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "entries.h"
+#include "libls.h"
+#include "listing.h"
+#include "print.h"
+#include "scan.h"
+#include "timefmt.h"
+#include "util.h"
+
+/* larger than any formatted row: PATH_MAX for the link target */
+#define ROW_SIZE (LINE_SIZE + PATH_MAX)
+
+struct ls_dir {
+  struct flags flag;
+  struct statdir_info info;
+  char *path;
+  int next;       /* position in the listing of the next entry */
+  int current;    /* index of the entry last returned by ls_next or -1 */
+};
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+/* guards the process-wide caches of names.c and timefmt.c */
+static pthread_mutex_t format_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Initializes what ls initializes once in main.
+ */
+static void
+init(void)
+{
+  scan_init();
+}
+
+/*
+ * Sets the ls flags which correspond to the LS_* flags of libls.h.
+ */
+static void
+flags_from(struct flags *flag, unsigned int flags, unsigned int fields)
+{
+  flags_init(flag);
+  flag->aflag = (flags & LS_ALL) != 0;
+  if (flags & LS_NUMERIC)
+    flag->nflag = 1;
+  else if (flags & LS_LONG)
+    flag->lflag = 1;
+  flag->iflag = (flags & LS_INODE) != 0;
+  flag->sflag = (flags & LS_BLOCKS) != 0;
+  flag->Fflag = (flags & LS_CLASSIFY) != 0;
+  flag->hflag = (flags & LS_HUMAN) != 0;
+  flag->kflag = (flags & LS_KILO) != 0;
+  flag->qflag = (flags & LS_QUOTE) != 0;
+  flag->fflag = (flags & LS_UNSORTED) != 0;
+  flag->rflag = (flags & LS_REVERSE) != 0;
+  flag->Sflag = (flags & LS_SORT_SIZE) != 0;
+  flag->tflag = (flags & LS_SORT_TIME) != 0;
+  if (flags & LS_CTIME)
+    flag->cflag = 1;
+  else if (flags & LS_ATIME)
+    flag->uflag = 1;
+  flag->dont_sync = (flags & LS_DONT_SYNC) != 0;
+  flag->stat_mask = fields;
+  flag->oneflag = 1;
+  sort_init(flag);
+}
+
+/*
+ * Reads the directory path with the given LS_* flags and sorts it as ls
+ * does. fields holds STATX_* fields which ls_next is to return besides
+ * those which the flags need.
+ * Returns the handle on success. Otherwise, returns NULL and sets errno.
+ */
+struct ls_dir *
+ls_opendir(const char *path, unsigned int flags, unsigned int fields)
+{
+  struct statdir_error e;
+  struct ls_dir *dir;
+
+  if (path == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+  pthread_once(&init_once, init);
+
+  if ((dir = (struct ls_dir *)malloc(sizeof(struct ls_dir))) == NULL)
+    return NULL;
+  if ((dir->path = strdup(path)) == NULL) {
+    free(dir);
+    return NULL;
+  }
+  flags_from(&dir->flag, flags, fields);
+  if (statdir(dir->path, &dir->flag, &dir->info, &e) < 0) {
+    free(dir->path);
+    free(dir);
+    errno = (e.error != 0) ? e.error : EINVAL;
+    return NULL;
+  }
+  sort_entries(&dir->info.entries, &dir->flag);
+  dir->next = 0;
+  dir->current = -1;
+
+  return dir;
+}
+
+/*
+ * Returns the number of entries of dir.
+ */
+int
+ls_count(const struct ls_dir *dir)
+{
+  assert(dir != NULL);
+  return dir->info.entries.count;
+}
+
+/*
+ * Stores the next entry of dir in entry.
+ * Returns 1, if there is one, and 0 at the end of the listing.
+ */
+int
+ls_next(struct ls_dir *dir, struct ls_entry *entry)
+{
+  struct entry_list *list;
+
+  assert((dir != NULL) && (entry != NULL));
+
+  list = &dir->info.entries;
+  if (dir->next == list->count)
+    return 0;
+  dir->current = list->order[dir->next++];
+  entry->name = ENTRY_NAME(list, dir->current);
+  entry_stat(list, dir->current, &entry->st);
+
+  return 1;
+}
+
+/*
+ * Formats the entry last returned by ls_next like ls prints it with the
+ * flags of dir, with single spaces between the fields instead of aligned
+ * columns, into buf of the given size.
+ * Returns the length of the null-terminated row on success. Otherwise,
+ * returns -1 and sets errno, to ERANGE, if the row does not fit.
+ */
+int
+ls_format(struct ls_dir *dir, char *buf, size_t size)
+{
+  char row[ROW_SIZE];
+  struct stat sb;
+  size_t length;
+  char *p;
+
+  assert(dir != NULL);
+
+  if ((dir->current < 0) || (buf == NULL) || (size == 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+  entry_stat(&dir->info.entries, dir->current, &sb);
+  pthread_mutex_lock(&format_lock);
+  format_refresh();
+  print_file(row, sizeof(row), dir->path, dir->info.fd,
+    ENTRY_NAME(&dir->info.entries, dir->current), &sb, &dir->flag);
+  pthread_mutex_unlock(&format_lock);
+  /* a full row may have been truncated */
+  length = strnlen(row, sizeof(row));
+  if ((length >= size) || (length >= (sizeof(row) - 1))) {
+    errno = ERANGE;
+    return -1;
+  }
+  for (p = row; (p = memchr(p, DELIMITER, length - (p - row))) != NULL; p++)
+    *p = ' ';
+  memcpy(buf, row, length + 1);
+
+  return length;
+}
+
+/*
+ * Closes dir and frees its entries.
+ */
+void
+ls_closedir(struct ls_dir *dir)
+{
+  if (dir == NULL)
+    return;
+  close(dir->info.fd);
+  entries_free(&dir->info.entries);
+  spill_free(dir->info.spill);
+  free(dir->path);
+  free(dir);
+}
@@ -0,0 +1,51 @@
+#ifndef _LIBLS_H_
+#define _LIBLS_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <stddef.h>
+
+/*
+ * Flags of ls_opendir, named after the flags of ls which they correspond
+ * to.
+ */
+#define LS_ALL        0x0001    /* a: include '.', '..' and hidden files */
+#define LS_LONG       0x0002    /* l: long format */
+#define LS_NUMERIC    0x0004    /* n: long format with numeric ids */
+#define LS_INODE      0x0008    /* i: inode numbers */
+#define LS_BLOCKS     0x0010    /* s: blocks */
+#define LS_CLASSIFY   0x0020    /* F: type symbols after the names */
+#define LS_HUMAN      0x0040    /* h: human-readable sizes */
+#define LS_KILO       0x0080    /* k: blocks in KiB */
+#define LS_QUOTE      0x0100    /* q: '?' for non-printable characters */
+#define LS_UNSORTED   0x0200    /* f: directory order */
+#define LS_REVERSE    0x0400    /* r: reverse order */
+#define LS_SORT_SIZE  0x0800    /* S: largest first */
+#define LS_SORT_TIME  0x1000    /* t: newest first */
+#define LS_ATIME      0x2000    /* u: access times */
+#define LS_CTIME      0x4000    /* c: status change times */
+#define LS_DONT_SYNC  0x8000    /* AT_STATX_DONT_SYNC, see LS_STATX_DONT_SYNC */
+
+/*
+ * An entry returned by ls_next. Besides the file type in st_mode, st holds
+ * the statx(2) fields passed to ls_opendir and those the flags need; the
+ * other fields are zero. name stays valid until ls_closedir.
+ */
+struct ls_entry {
+  const char *name;
+  struct stat st;
+};
+
+struct ls_dir;
+
+/* the only symbols which libls.a exports, see the Makefile */
+#define LS_API __attribute__((visibility("default")))
+
+LS_API struct ls_dir *ls_opendir(const char *, unsigned int, unsigned int);
+LS_API int ls_count(const struct ls_dir *);
+LS_API int ls_next(struct ls_dir *, struct ls_entry *);
+LS_API int ls_format(struct ls_dir *, char *, size_t);
+LS_API void ls_closedir(struct ls_dir *);
+
+#endif /* !_LIBLS_H_ */
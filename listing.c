@@ -0,0 +1,662 @@
+/*
+ * Reading, sorting and printing the contents of a single directory.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "dirread.h"
+#include "entries.h"
+#include "listing.h"
+#include "metadata.h"
+#include "output.h"
+#include "print.h"
+#include "sort.h"
+#include "spill.h"
+#include "stats.h"
+#include "util.h"
+
+/*
+ * Stores the given message and errno(3) value in e.
+ */
+static void
+statdir_error_set(struct statdir_error *e, int error, const char *fmt, ...)
+{
+  va_list ap;
+
+  assert((e != NULL) && (fmt != NULL));
+
+  e->error = error;
+  va_start(ap, fmt);
+  vsnprintf(e->msg, sizeof(e->msg), fmt, ap);
+  va_end(ap);
+}
+
+/*
+ * Describes in e that the entry with index failed of list in the directory
+ * path could not be stat(2)ed, as errno(3) tells.
+ */
+static void
+stat_error_set(struct statdir_error *e, const char *path,
+  const struct entry_list *list, int failed)
+{
+  char name[PATH_MAX];
+  int error;
+
+  error = errno;
+  /* a path too long for full_path must not terminate the library */
+  if (path_join(name, path, ENTRY_NAME(list, failed)) < 0)
+    statdir_error_set(e, error, "lstat_path lstat error for %s in %s",
+      ENTRY_NAME(list, failed), path);
+  else
+    statdir_error_set(e, error, "lstat_path lstat error for %s", name);
+}
+
+/*
+ * Returns whether the directory entry rec, read from the directory fd, is
+ * to be listed, see display_file and filters_match. The R flag descends
+ * into directories whatever the I patterns, so a name which matches none
+ * of them is kept, if it names a directory; for this and only for this,
+ * an entry without a type is stat(2)ed and its type is stored in rec.
+ */
+static int
+keep_entry(const char *path, int fd, struct dir_record *rec,
+  const struct stat_request *req, struct flags *flag)
+{
+  struct stat_request type_req;
+  struct stat sb;
+
+  if (!display_file(path, rec->name, flag))
+    return 0;
+  if (filters_match(&flag->filters, rec->name, 0))
+    return 1;
+  if (!flag->Rflag || (flag->filters.includes == 0))
+    return 0;
+  if (rec->type == DT_UNKNOWN) {
+    type_req.mask = STATX_TYPE;
+    type_req.flags = req->flags;
+    if (statx_at(fd, rec->name, &type_req, &sb) == 0)
+      rec->type = IFTODT(sb.st_mode);
+  }
+
+  return (rec->type == DT_DIR) && filters_match(&flag->filters, rec->name, 1);
+}
+
+/*
+ * Returns whether statdir may move entries beyond the memory budget of
+ * flag to the runs of spill.c. The runs are only merged when the directory
+ * is printed line by line, so the entries must not be needed otherwise:
+ * not by the R flag for the subdirectories, the D flag for the usage, the
+ * W flag for later changes or the C and x flags for the columns. The N
+ * flag bounds the memory itself, and unsorted listings are not merged.
+ */
+static int
+can_spill(struct flags *flag)
+{
+  return (flag->memory > 0) && !flag->fflag && !flag->Rflag && !flag->Dflag
+    && !flag->Wflag && !flag->Cflag && !flag->xflag && (flag->limit == 0);
+}
+
+/*
+ * Sorts the stat(2)ed entries of list, moves them to a new run of
+ * dir_info->spill and empties list.
+ * Returns 0 on success. Otherwise, returns -1 and describes the problem in
+ * e.
+ */
+static int
+spill_run(const char *path, struct entry_list *list, struct flags *flag,
+  struct statdir_info *dir_info, struct statdir_error *e)
+{
+  sort_entries(list, flag);
+  if (spill_add(&dir_info->spill, list, flag) < 0) {
+    statdir_error_set(e, errno, "cannot write the entries of %s to %s", path,
+      flag->spill_dir);
+    return -1;
+  }
+  entries_clear(list);
+
+  return 0;
+}
+
+/*
+ * For the N flag, reduces list to the first flag->limit entries in the
+ * order of the listing, if it holds more.
+ * Returns 0 on success and -1 on failure.
+ */
+static int
+select_top(struct entry_list *list, struct flags *flag)
+{
+  if ((flag->limit == 0) || (list->count <= flag->limit))
+    return 0;
+  /* the f flag keeps the first entries read */
+  sort_entries(list, flag);
+
+  return entries_keep(list, flag->limit);
+}
+
+/*
+ * Prints the error stored by statdir and terminates this process.
+ */
+void
+statdir_fail(struct statdir_error *e)
+{
+  assert(e != NULL);
+
+  if (e->error != 0) {
+    errno = e->error;
+    err(EXIT_FAILURE, "%s", e->msg);
+  } else
+    errx(EXIT_FAILURE, "%s", e->msg);
+}
+
+/*
+ * Stores the entries of the given directory with their names and lstat(2)
+ * values in dir_info.
+ * The directory is read in a single pass and the list grows as needed.
+ * If the flags need nothing but the file type, it is taken from the
+ * directory entry and lstat(2) is skipped. Otherwise, statx(2) is called
+ * relative to the directory descriptor with only the needed fields, once
+ * all names are known, so that stat_entries can spread the work.
+ * For the N flag, only the first flag->limit entries of the listing are
+ * kept: whenever SELECT_BATCH more have been read, they are stat(2)ed and
+ * the list is sorted and cut down, so memory does not grow with the size
+ * of the directory. The f flag stops reading after flag->limit entries.
+ * Similarly, whenever the entries exceed the budget of LS_MEMORY, they are
+ * sorted and written to a run in dir_info->spill, see can_spill. The
+ * entry list is empty then, and print_listing merges the runs.
+ * The directory stays open for print_entries. The names to stat are kept in
+ * the scratch arena of the calling thread, see arena_scratch.
+ * Free the entry list with entries_free and close(2) the descriptor
+ * contained in dir_info.
+ * Returns 0 on success. Otherwise, returns -1 and describes the problem in
+ * e without terminating the process, so that threads may call this.
+ */
+int
+statdir(const char *path, struct flags *flag, struct statdir_info *dir_info,
+  struct statdir_error *e)
+{
+  struct entry_list *list;
+  struct arena *scratch;
+  struct arena_mark mark;
+  int *todo;
+  uint64_t *todo_ino;     /* inode numbers of todo, see stat_entries */
+  int todoc;
+  int todo_size;
+  struct dir_reader dir;
+  struct dir_record rec;
+  struct stat_request req;
+  struct timespec start;
+  struct timespec phase;
+  struct stat dir_sb;
+  int cached;
+  int full_stat;
+  int spill;
+  long count;
+  int failed;
+  int r;
+
+  assert((path != NULL) && (flag != NULL) && (dir_info != NULL)
+    && (e != NULL));
+
+  STATS_START(start);
+
+  full_stat = needs_stat(flag);
+  stat_request_init(&req, flag);
+  list = &dir_info->entries;
+  entries_init(list, req.mask);
+  dir_info->spill = NULL;
+  spill = can_spill(flag);
+  scratch = arena_scratch();
+  arena_mark(scratch, &mark);
+  todo_size = ENTRIES_INIT_SIZE;
+  todo = (int *)arena_alloc(scratch, sizeof(int) * todo_size);
+  todo_ino = (uint64_t *)arena_alloc(scratch, sizeof(uint64_t) * todo_size);
+  if ((todo == NULL) || (todo_ino == NULL)) {
+    statdir_error_set(e, errno, "not enough memory for files names in %s",
+      path);
+    goto fail;
+  }
+
+  if (dir_open(&dir, path) < 0) {
+    statdir_error_set(e, errno, "error opendir %s", path);
+    goto fail;
+  }
+  /*
+   * The directory is stat(2)ed before it is read, so that changes during
+   * the read make the stored entries stale. Filtered lists are not
+   * cached, since the cache holds whole directories.
+   */
+  cached = (flag->cache_dir != NULL) && (flag->filters.count == 0)
+    && (fstat(dir.fd, &dir_sb) == 0);
+  if (cached && (cache_load(flag, &dir_sb, list, &req) == 0)) {
+    arena_release(scratch, &mark);
+    goto done;
+  }
+  /* collect the names, remembering the entries that need lstat(2) */
+  STATS_START(phase);
+  todoc = 0;
+  while ((r = dir_next(&dir, &rec)) > 0) {
+    int index;
+
+    if (!keep_entry(path, dir.fd, &rec, &req, flag))
+      continue;
+    if ((index = entries_add(list, rec.name, DTTOIF(rec.type), rec.ino)) < 0)
+    {
+      statdir_error_set(e, errno, "not enough memory for files names in %s",
+        path);
+      goto fail_dir;
+    }
+    if (full_stat || (rec.type == DT_UNKNOWN)
+      || (flag->Fflag && (rec.type == DT_REG))) {
+      if (todoc == todo_size) {
+        int *new_todo;
+        uint64_t *new_ino;
+
+        if ((new_todo = (int *)arena_grow(scratch, todo,
+          sizeof(int) * todo_size, sizeof(int) * 2 * todo_size)) != NULL)
+          todo = new_todo;
+        if ((new_ino = (uint64_t *)arena_grow(scratch, todo_ino,
+          sizeof(uint64_t) * todo_size, sizeof(uint64_t) * 2 * todo_size))
+          != NULL)
+          todo_ino = new_ino;
+        todo_size *= 2;
+        if ((new_todo == NULL) || (new_ino == NULL)) {
+          statdir_error_set(e, errno,
+            "not enough memory for files names in %s", path);
+          goto fail_dir;
+        }
+      }
+      todo_ino[todoc] = rec.ino;
+      todo[todoc++] = index;
+    }
+    if ((flag->limit > 0) && flag->fflag && (list->count == flag->limit))
+      break;
+    if ((flag->limit > 0) && (list->count >= (flag->limit + SELECT_BATCH))) {
+      STATS_STOP(STATS_READ, phase);
+      STATS_START(phase);
+      if (stat_entries(dir.fd, list, todo, todo_ino, todoc, &req, flag,
+        &failed) < 0) {
+        stat_error_set(e, path, list, failed);
+        goto fail_dir;
+      }
+      STATS_STOP(STATS_STAT, phase);
+      todoc = 0;
+      if (select_top(list, flag) < 0) {
+        statdir_error_set(e, errno, "not enough memory for files names in %s",
+          path);
+        goto fail_dir;
+      }
+      STATS_START(phase);
+    }
+    if (spill && (list->count >= SPILL_MIN) && ((entries_memory(list)
+      + (sizeof(int) + sizeof(uint64_t)) * todo_size) > flag->memory)) {
+      STATS_STOP(STATS_READ, phase);
+      STATS_START(phase);
+      if (stat_entries(dir.fd, list, todo, todo_ino, todoc, &req, flag,
+        &failed) < 0) {
+        stat_error_set(e, path, list, failed);
+        goto fail_dir;
+      }
+      STATS_STOP(STATS_STAT, phase);
+      todoc = 0;
+      if (spill_run(path, list, flag, dir_info, e) < 0)
+        goto fail_dir;
+      STATS_START(phase);
+    }
+  }
+  if (r < 0) {
+    statdir_error_set(e, errno, "error readdir %s", path);
+    goto fail_dir;
+  }
+  STATS_STOP(STATS_READ, phase);
+
+  STATS_START(phase);
+  if (stat_entries(dir.fd, list, todo, todo_ino, todoc, &req, flag, &failed)
+    < 0) {
+    stat_error_set(e, path, list, failed);
+    goto fail_dir;
+  }
+  arena_release(scratch, &mark);
+  STATS_STOP(STATS_STAT, phase);
+  if ((dir_info->spill != NULL) && (list->count > 0)
+    && (spill_run(path, list, flag, dir_info, e) < 0))
+    goto fail_dir;
+  /* a cut down or spilled list is not worth storing */
+  if (cached && (flag->limit == 0) && (dir_info->spill == NULL))
+    cache_store(flag, &dir_sb, list, &req);
+
+done:
+  if (select_top(list, flag) < 0) {
+    statdir_error_set(e, errno, "not enough memory for files names in %s",
+      path);
+    goto fail_dir;
+  }
+  dir_info->fd = dir_detach(&dir);
+  count = list->count;
+  if (dir_info->spill != NULL)
+    count += spill_count(dir_info->spill);
+  STATS_COUNT(STATS_DIRS, 1);
+  STATS_COUNT(STATS_ENTRIES, count);
+  STATS_DIR(path, start, count);
+
+  return 0;
+
+fail_dir:
+  dir_close(&dir);
+fail:
+  entries_free(list);
+  spill_free(dir_info->spill);
+  dir_info->spill = NULL;
+  arena_release(scratch, &mark);
+  return -1;
+}
+
+/*
+ * Returns whether the directories can be listed with stream_dir, without
+ * knowing all entries first. That is the case for unsorted (f flag) line by
+ * line output, unless the R flag needs the names of subdirectories later.
+ * If fields other than the name are shown, they can only be aligned to
+ * the entries seen so far and the total line cannot be printed, so that is
+ * only done, if requested with stream_long.
+ */
+int
+can_stream(struct flags *flag)
+{
+  int fields;
+
+  assert(flag != NULL);
+
+  if (!flag->fflag || flag->Rflag || flag->Cflag || flag->xflag)
+    return 0;
+  fields = flag->lflag || flag->nflag || flag->iflag || flag->sflag;
+  return !fields || flag->stream_long || (flag->machine != MACHINE_NONE);
+}
+
+/*
+ * Prints the entries of the given directory in directory order, while it
+ * is read. Every getdents64(2) batch, but at most STREAM_BATCH entries, is
+ * stat(2)ed and printed, before the next one is read, so only the memory
+ * for one batch is needed.
+ * Returns 0 on success. Otherwise, returns -1 and describes the problem in
+ * e, like statdir. The entries before the problem are printed already.
+ */
+int
+stream_dir(const char *path, struct flags *flag, struct statdir_error *e)
+{
+  struct entry_list list;
+  int todo[STREAM_BATCH];
+  uint64_t todo_ino[STREAM_BATCH];
+  int todoc;
+  struct dir_reader dir;
+  struct dir_record rec;
+  struct stat_request req;
+  struct timespec start;
+  struct timespec phase;
+  long entries;
+  int full_stat;
+  int failed;
+  int first;
+  int r;
+
+  assert((path != NULL) && (flag != NULL) && (e != NULL));
+
+  STATS_START(start);
+
+  full_stat = needs_stat(flag);
+  stat_request_init(&req, flag);
+  entries_init(&list, req.mask);
+
+  if (dir_open(&dir, path) < 0) {
+    statdir_error_set(e, errno, "error opendir %s", path);
+    entries_free(&list);
+    return -1;
+  }
+  todoc = 0;
+  first = 1;
+  entries = 0;
+  STATS_START(phase);
+  while ((r = dir_next(&dir, &rec)) > 0) {
+    int index;
+
+    if (keep_entry(path, dir.fd, &rec, &req, flag)) {
+      if ((index = entries_add(&list, rec.name, DTTOIF(rec.type), rec.ino))
+        < 0) {
+        statdir_error_set(e, errno, "not enough memory for files names in %s",
+          path);
+        goto fail;
+      }
+      if (full_stat || (rec.type == DT_UNKNOWN)
+        || (flag->Fflag && (rec.type == DT_REG))) {
+        todo_ino[todoc] = rec.ino;
+        todo[todoc++] = index;
+      }
+      if ((flag->limit > 0) && ((entries + list.count) == flag->limit))
+        break;
+    }
+
+    if ((list.count == STREAM_BATCH)
+      || ((list.count > 0) && !dir_buffered(&dir))) {
+      STATS_STOP(STATS_READ, phase);
+      STATS_START(phase);
+      if (stat_entries(dir.fd, &list, todo, todo_ino, todoc, &req, flag,
+        &failed) < 0)
+        goto fail_stat;
+      STATS_STOP(STATS_STAT, phase);
+      print_batch(path, dir.fd, &list, list.order, list.count, flag, first);
+      entries += list.count;
+      entries_clear(&list);
+      todoc = 0;
+      first = 0;
+      STATS_START(phase);
+    }
+  }
+  if (r < 0) {
+    statdir_error_set(e, errno, "error readdir %s", path);
+    goto fail;
+  }
+  STATS_STOP(STATS_READ, phase);
+  STATS_START(phase);
+  if (stat_entries(dir.fd, &list, todo, todo_ino, todoc, &req, flag, &failed)
+    < 0)
+    goto fail_stat;
+  STATS_STOP(STATS_STAT, phase);
+  print_batch(path, dir.fd, &list, list.order, list.count, flag, first);
+  entries += list.count;
+  STATS_COUNT(STATS_DIRS, 1);
+  STATS_COUNT(STATS_ENTRIES, entries);
+  STATS_DIR(path, start, entries);
+
+  entries_free(&list);
+  if (dir_close(&dir) < 0)
+    err(EXIT_FAILURE, "error closedir %s", path);
+
+  return 0;
+
+fail_stat:
+  stat_error_set(e, path, &list, failed);
+fail:
+  dir_close(&dir);
+  entries_free(&list);
+  return -1;
+}
+
+/*
+ * Selects the sort order for all directories from flag, once the flags are
+ * final.
+ */
+void
+sort_init(struct flags *flag)
+{
+  enum sort_type key;
+
+  assert(flag != NULL);
+
+  key = SORT_LEXICO;
+  if (flag->tflag) {
+    /* sort according to timestamp */
+    key = SORT_MTIME;
+    if (flag->cflag)
+      key = SORT_CTIME;
+    else if (flag->uflag)
+      key = SORT_ATIME;
+  } else if (flag->Sflag)
+    /* sort according to size */
+    key = SORT_SIZE;
+  sort_spec_init(&flag->sort, key, flag->rflag);
+}
+
+/*
+ * Sorts the entries as selected by sort_init by permuting list->order.
+ * Threads may sort different lists at the same time.
+ */
+void
+sort_entries(struct entry_list *list, struct flags *flag)
+{
+  struct timespec start;
+
+  assert((list != NULL) && (flag != NULL));
+
+  /* f flag means no sorting */
+  if (flag->fflag)
+    return;
+
+  STATS_START(start);
+  sort_order(list, list->order, list->count, &flag->sort);
+  STATS_STOP(STATS_SORT, start);
+}
+
+/*
+ * Adds up the number of blocks of the entries of list in the given
+ * directory which are to be displayed.
+ */
+static blkcnt_t
+total_blks(const char *dir, struct entry_list *list, struct flags *flag)
+{
+  blkcnt_t total;
+  int i;
+
+  assert ((dir != NULL) && (list != NULL) && (flag != NULL));
+
+  total = 0;
+  for (i = 0; i < list->count; i++) {
+    if (display_file(dir, ENTRY_NAME(list, i), flag))
+      total += list->blocks[i];
+  }
+
+  return total;
+}
+
+/*
+ * Returns whether listings start with the total number of blocks.
+ */
+static int
+needs_total(struct flags *flag)
+{
+  return (flag->machine == MACHINE_NONE) && (flag->lflag || flag->nflag
+    || (flag->sflag && isatty(STDOUT_FILENO)));
+}
+
+/*
+ * Prints the line with the given total number of blocks.
+ */
+static void
+print_total(blkcnt_t total, struct flags *flag)
+{
+  char buf[64];
+  char *buf_ptr;
+  size_t remain;
+
+  buf_ptr = buf;
+  remain = 64;
+  print_blks(&buf_ptr, &remain, total, flag);
+  output_write("total ", 6);
+  output_write(buf, buf_ptr - buf);
+  output_char('\n');
+}
+
+/*
+ * Prints the entries of a directory which statdir moved to runs. The runs
+ * are merged twice: once to add up the blocks and to measure the fields,
+ * and once to print the entries in batches with the widths of all of them,
+ * so that the output is that of print_entries.
+ */
+static void
+print_spilled(const char *dir, struct statdir_info *dir_info,
+  struct flags *flag)
+{
+  struct entry_list batch;
+  blkcnt_t total;
+  int first;
+  int n;
+
+  entries_init(&batch, dir_info->entries.fields);
+  first = 1;
+  if (flag->machine == MACHINE_NONE) {
+    total = 0;
+    if (spill_rewind(dir_info->spill) < 0)
+      goto fail;
+    while ((n = spill_next(dir_info->spill, &batch)) > 0) {
+      if (needs_total(flag))
+        total += total_blks(dir, &batch, flag);
+      measure_batch(dir, dir_info->fd, &batch, batch.order, n, flag, first);
+      first = 0;
+    }
+    if (n < 0)
+      goto fail;
+    if (needs_total(flag))
+      print_total(total, flag);
+  }
+  if (spill_rewind(dir_info->spill) < 0)
+    goto fail;
+  while ((n = spill_next(dir_info->spill, &batch)) > 0) {
+    print_batch(dir, dir_info->fd, &batch, batch.order, n, flag, first);
+    first = 0;
+  }
+  if (n < 0)
+    goto fail;
+  entries_free(&batch);
+  return;
+
+fail:
+  err(EXIT_FAILURE, "cannot read the entries of %s from %s", dir,
+    flag->spill_dir);
+}
+
+/*
+ * Prints the total number of blocks, if desired, and the entries of the
+ * given directory.
+ */
+void
+print_listing(const char *dir, struct statdir_info *dir_info,
+  struct flags *flag)
+{
+  assert ((dir != NULL) && (dir_info != NULL) && (flag != NULL));
+
+  if (dir_info->spill != NULL) {
+    print_spilled(dir, dir_info, flag);
+    return;
+  }
+
+  /* print total FS blocks */
+  if (needs_total(flag))
+    print_total(total_blks(dir, &dir_info->entries, flag), flag);
+
+  /* print file entries itself */
+  print_entries(dir, dir_info->fd, &dir_info->entries,
+    dir_info->entries.order, dir_info->entries.count, flag);
+}
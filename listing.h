@@ -0,0 +1,41 @@
+#ifndef _LISTING_H_
+#define _LISTING_H_
+
+#include <limits.h>
+
+#include "entries.h"
+#include "spill.h"
+#include "util.h"
+
+/* initial number of entries to stat allocated per directory */
+#define ENTRIES_INIT_SIZE 64
+/* maximum number of entries printed at once by stream_dir */
+#define STREAM_BATCH 4096
+/* entries read beyond the N flag limit before the list is cut down */
+#define SELECT_BATCH 4096
+
+struct statdir_info {
+  struct entry_list entries;
+  struct spill *spill;    /* sorted runs of entries beyond LS_MEMORY or NULL */
+  int fd;
+};
+
+/*
+ * Describes why a directory could not be read, so that the error can be
+ * reported with statdir_fail at the right place in the output.
+ */
+struct statdir_error {
+  int error;    /* errno(3) value or 0, if there is none */
+  char msg[PATH_MAX + 64];
+};
+
+int statdir(const char *, struct flags *, struct statdir_info *,
+  struct statdir_error *);
+void statdir_fail(struct statdir_error *);
+int can_stream(struct flags *);
+int stream_dir(const char *, struct flags *, struct statdir_error *);
+void sort_init(struct flags *);
+void sort_entries(struct entry_list *, struct flags *);
+void print_listing(const char *, struct statdir_info *, struct flags *);
+
+#endif /* !_LISTING_H_ */
@@ -14,6 +14,9 @@
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <bsd/stdlib.h>
 #include <string.h>
@@ -22,21 +25,32 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "entries.h"
+#include "listing.h"
+#include "names.h"
+#include "output.h"
 #include "print.h"
+#include "scan.h"
+#include "stats.h"
+#include "usage.h"
 #include "util.h"
+#include "walk.h"
+#include "watch.h"
 
-struct statdir_info {
-  struct file_entry *entry;
-  int entryc;
-};
+/* initial number of nested directories of the R traversal */
+#define TRAVERSE_STACK_SIZE 16
+
+struct dir_frame;
 
 int main(int, char *[]);
+static void list_dir(const char *, struct flags *, int, int);
+static void list_one(char *, struct flags *, int, int, struct arena *,
+  struct dir_frame *);
 static void traverse(const char *, struct flags *, int, int);
 static void stat_and_print(const char *, const char *, struct flags *);
-static struct statdir_info statdir(const char *, struct flags *);
-static int file_count(const char*);
-static blkcnt_t total_blks(const char *, struct statdir_info *,
-  struct flags *);
+static int parse_count(const char *);
+static size_t parse_size(const char *, const char *);
 static void usage(void);
 
 /*
@@ -46,12 +60,13 @@ int
 main(int argc, char *argv[])
 {
   struct flags flag;
+  char *env;
   int ch;
 
   flags_init(&flag);  
   setprogname((char *)argv[0]);
 
-  while ((ch = getopt(argc, argv, "AaCcdFfhiklnqRrSstuwx1")) != -1) {
+  while ((ch = getopt(argc, argv, "AaCcDdFfhI:iklM:N:nqRrSstuWwX:x1")) != -1) {
     switch (ch) {
     case 'A':
       flag.Aflag = 1;
@@ -70,6 +85,10 @@ main(int argc, char *argv[])
       flag.cflag = 1;
       flag.uflag = 0; /* override */
       break;
+    case 'D':
+      flag.Dflag = 1;
+      flag.Rflag = 1;
+      break;
     case 'd':
       flag.dflag = 1;
       break;
@@ -82,6 +101,10 @@ main(int argc, char *argv[])
     case 'h':
       flag.hflag = 1;
       break;
+    case 'I':
+      if (filters_add(&flag.filters, optarg, 0) < 0)
+        err(EXIT_FAILURE, "not enough memory for the I flag");
+      break;
     case 'i':
       flag.iflag = 1;
       break;
@@ -95,6 +118,13 @@ main(int argc, char *argv[])
       flag.xflag = 0;   /* override */
       flag.oneflag = 0; /* override */
       break;
+    case 'M':
+      if (machine_format_parse(optarg, &flag.machine) < 0)
+        errx(EXIT_FAILURE, "unknown format %s for the M flag", optarg);
+      break;
+    case 'N':
+      flag.limit = parse_count(optarg);
+      break;
     case 'n':
       flag.nflag = 1;
       flag.Cflag = 0;   /* override */
@@ -125,10 +155,17 @@ main(int argc, char *argv[])
       flag.uflag = 1;
       flag.cflag = 0; /* override */
       break;
+    case 'W':
+      flag.Wflag = 1;
+      break;
     case 'w':
       flag.wflag = 1;
       flag.qflag = 0; /* override */
       break;
+    case 'X':
+      if (filters_add(&flag.filters, optarg, 1) < 0)
+        err(EXIT_FAILURE, "not enough memory for the X flag");
+      break;
     case 'x':
       flag.xflag = 1;
       flag.Cflag = 0;   /* override */
@@ -152,8 +189,59 @@ main(int argc, char *argv[])
   argc -= optind;
   argv += optind;
 
-  /* set this for cmp function from util.h */
-  reverse = flag.rflag;
+  if (flag.Wflag && (flag.Rflag || flag.dflag || flag.limit))
+    errx(EXIT_FAILURE, "the W flag cannot be combined with the %s flag",
+      flag.Rflag ? "R" : (flag.dflag ? "d" : "N"));
+
+  sort_init(&flag);
+  scan_init();
+
+  if (getenv("LS_STATX_DONT_SYNC") != NULL)
+    flag.dont_sync = 1;
+  if ((env = getenv("LS_STAT_THREADS")) != NULL)
+    flag.stat_threads = atoi(env);
+  if (flag.stat_threads > 1)
+    flag.stat_backend = STAT_THREADS;
+  if ((env = getenv("LS_STAT_BACKEND")) != NULL) {
+    if (strcmp(env, "sync") == 0)
+      flag.stat_backend = STAT_SYNC;
+    else if (strcmp(env, "threads") == 0)
+      flag.stat_backend = STAT_THREADS;
+    else if (strcmp(env, "uring") == 0)
+      flag.stat_backend = STAT_URING;
+    else
+      errx(EXIT_FAILURE, "unknown LS_STAT_BACKEND %s", env);
+  }
+  if ((env = getenv("LS_URING_DEPTH")) != NULL)
+    flag.uring_depth = atoi(env);
+  if ((env = getenv("LS_INODE_ORDER")) != NULL)
+    flag.inode_order = atoi(env);
+  if ((env = getenv("LS_WALK_THREADS")) != NULL)
+    flag.walk_threads = atoi(env);
+  if (getenv("LS_PRELOAD_NAMES") != NULL)
+    flag.preload_names = 1;
+  if (getenv("LS_STREAM_LONG") != NULL)
+    flag.stream_long = 1;
+  if ((env = getenv("LS_FLUSH")) != NULL) {
+    if (strcmp(env, "line") == 0)
+      flag.output_flush = FLUSH_LINE;
+    else if (strcmp(env, "full") == 0)
+      flag.output_flush = FLUSH_FULL;
+    else
+      errx(EXIT_FAILURE, "unknown LS_FLUSH %s", env);
+  }
+  if (((env = getenv("LS_CACHE")) != NULL) && (*env != 0))
+    flag.cache_dir = env;
+  if (((env = getenv("LS_MEMORY")) != NULL) && (*env != 0))
+    flag.memory = parse_size("LS_MEMORY", env);
+  if (((env = getenv("TMPDIR")) != NULL) && (*env != 0))
+    flag.spill_dir = env;
+  /* before output_init, so that the statistics follow the output at exit */
+  stats_init();
+  output_init(flag.output_flush);
+
+  if (flag.preload_names && flag.lflag)
+    names_preload();
 
   /* flag A is always set for super user */
   if (getuid() == 0)
@@ -185,10 +273,14 @@ main(int argc, char *argv[])
 
   if (argc == 0) {
     /* no file provided: list the current directory. */
-    if (flag.dflag)
+    if (flag.Wflag) {
+      char *pwd = PWD_STRING;
+
+      watch(&pwd, 1, &flag, 0);
+    } else if (flag.dflag)
       stat_and_print(PWD_STRING, PWD_STRING, &flag);
     else
-      traverse(PWD_STRING, &flag, 0, 0);
+      list_dir(PWD_STRING, &flag, 0, 0);
   } else {
     /* 
      * List non-directories before directories
@@ -196,227 +288,313 @@ main(int argc, char *argv[])
      * non-directories and directories.
      */
     int non_dirc;
-    struct file_entry *entries;
+    struct entry_list entries;
+    struct stat_request req;
 
-    entries = (struct file_entry *)malloc(sizeof(struct file_entry) * argc);
-    if (entries == NULL)
-      err(EXIT_FAILURE, "malloc error for entries");
-    non_dirc = stat_and_sort(argv, argc, entries);
+    stat_request_init(&req, &flag);
+    entries_init(&entries, req.mask);
+    non_dirc = stat_and_sort(argv, argc, &entries, &flag);
     if (flag.dflag)
-      print_entries("", entries, argc, &flag);
+      print_entries("", AT_FDCWD, &entries, entries.order, argc, &flag);
     else {
       int i;
 
       if (non_dirc > 0) {
-        print_entries("", entries, non_dirc, &flag);
+        print_entries("", AT_FDCWD, &entries, entries.order, non_dirc,
+          &flag);
         /* print a newline before directories */
-        if ((argc - non_dirc) > 0)
-          putchar('\n');
+        if (((argc - non_dirc) > 0) && (flag.machine == MACHINE_NONE))
+          output_char('\n');
+      }
+      if ((non_dirc < argc) && (flag.Wflag
+        || ((flag.walk_threads > 1) && !can_stream(&flag)))) {
+        char **dirs;
+
+        /* the directories in the order of the listing */
+        if ((dirs = (char **)malloc(sizeof(char *) * (argc - non_dirc)))
+          == NULL)
+          err(EXIT_FAILURE, "not enough memory for directories");
+        for (i = non_dirc; i < argc; i++)
+          dirs[i - non_dirc] = ENTRY_NAME(&entries, entries.order[i]);
+        if (flag.Wflag)
+          watch(dirs, argc - non_dirc, &flag, argc > 1);
+        else
+          walk_operands(dirs, argc - non_dirc, &flag, argc > 1);
+        free(dirs);
+      } else {
+        for (i = non_dirc; i < argc; i++)
+          list_dir(ENTRY_NAME(&entries, entries.order[i]), &flag, argc > 1,
+            i - non_dirc);
       }
-      for (i = non_dirc; i < argc; i++)
-        traverse(entries[i].name, &flag, argc > 1, i - non_dirc);
     }
-    free(entries);
+    entries_free(&entries);
   }
 
-  return EXIT_SUCCESS;
+  return flag.rval;
 }
 
 /*
- * Traverses the given directory according to the flags.
- * intro determines whether a directory pre-amble should be printed
- * and depth determines the depth in the recursive call relative to
- * the user-provided directory.
+ * Lists the given directory, using the parallel traversal in walk.c for
+ * the R flag, if threads were requested.
  */
 static void
-traverse(const char *dir, struct flags *flag, int intro, int depth)
+list_dir(const char *dir, struct flags *flag, int intro, int depth)
+{
+  if (flag->Rflag && (flag->walk_threads > 1))
+    walk(dir, flag, intro, depth);
+  else
+    traverse(dir, flag, intro, depth);
+  if (flag->Dflag)
+    usage_print();
+}
+
+/*
+ * A directory of an R traversal whose subdirectories are still to be
+ * listed. Only the names of the subdirectories are kept, packed into one
+ * buffer in the order of the listing.
+ * Frames are pushed and popped in stack order, so their paths and names are
+ * allocated from an arena and the frame releases them to mark when popped.
+ */
+struct dir_frame {
+  struct arena_mark mark;   /* position before path */
+  char *path;
+  char *names;
+  int count;    /* number of subdirectories */
+  int next;     /* number of subdirectories listed already */
+  size_t pos;   /* offset of the next name in names */
+  int depth;
+  struct usage usage;   /* of the subtree listed so far, for the D flag */
+};
+
+/*
+ * Lists the given directory and, for the R flag, stores the names of its
+ * subdirectories in frame, allocated from paths after path. Frees the
+ * entries of the directory and resets the scratch arena before returning.
+ */
+static void
+list_one(char *path, struct flags *flag, int intro, int depth,
+  struct arena *paths, struct dir_frame *frame)
 {
   struct statdir_info dir_info;
-  struct file_entry *entries;
-  int entryc;
+  struct statdir_error dir_error;
+  struct entry_list *list;
+  size_t size;
   int i;
 
-  assert((dir != NULL) && (flag != NULL));
+  assert((path != NULL) && (flag != NULL) && (frame != NULL));
 
-  print_intro(dir, intro, depth, flag);
-
-  dir_info = statdir(dir, flag);
-  entries = dir_info.entry;
-  entryc = dir_info.entryc;
-
-  /* f flag means no sorting */
-  if (!flag->fflag) {
-    reverse = flag->rflag;
-    /* sort lexicographically first */
-    sort_key = SORT_LEXICO;
-    qsort(entries, entryc, sizeof(entries[0]), cmp);
-    if (flag->tflag) {
-      /* sort according to timestamp */
-      sort_key = SORT_MTIME;
-      if (flag->cflag)
-        sort_key = SORT_CTIME;
-      else if (flag->uflag)
-        sort_key = SORT_ATIME;
-      qsort(entries, entryc, sizeof(entries[0]), cmp);
-    } else if (flag->Sflag) {
-      /* sort according to size */
-      sort_key = SORT_SIZE;
-      qsort(entries, entryc, sizeof(entries[0]), cmp);
-    }
-  }
+  frame->path = path;
+  frame->names = NULL;
+  frame->count = 0;
+  frame->next = 0;
+  frame->pos = 0;
+  frame->depth = depth;
+  frame->usage.blocks = 0;
+  frame->usage.bytes = 0;
 
-  /* print total FS blocks */
-  if (flag->lflag || flag->nflag || (flag->sflag && isatty(STDOUT_FILENO))) {
-    char buf[64];
-    char *buf_ptr;
-    size_t remain;
-    blkcnt_t total;
-
-    buf_ptr = buf;
-    remain = 64;
-    total = total_blks(dir, &dir_info, flag);
-    print_blks(&buf_ptr, &remain, total, flag);
-    print_char(&buf_ptr, &remain, 0);
-    printf("total %s\n", buf);
+  print_intro(path, intro, depth, flag);
+
+  if (can_stream(flag)) {
+    if (stream_dir(path, flag, &dir_error) < 0)
+      statdir_fail(&dir_error);
+    arena_reset(arena_scratch());
+    return;
   }
 
-  /* print file entries itself */
-  print_entries(dir, entries, entryc, flag);
+  if (statdir(path, flag, &dir_info, &dir_error) < 0)
+    statdir_fail(&dir_error);
+  list = &dir_info.entries;
+
+  if (flag->Dflag)
+    usage_dir(path, dir_info.fd, list, &frame->usage);
+  sort_entries(list, flag);
+  print_listing(path, &dir_info, flag);
+  spill_free(dir_info.spill);
+  if (close(dir_info.fd) < 0)
+    err(EXIT_FAILURE, "error closedir %s", path);
 
   if (flag->Rflag) {
-    /* recursively traverse sub-directories */
-    for (i = 0; i < entryc; i++) {
-      char *path;
-      int traverse_dir;
-
-      traverse_dir = S_ISDIR(entries[i].sb.st_mode)
-        && !is_dot_dir(entries[i].name);
-      path = full_path(dir, entries[i].name);
-      if (traverse_dir)
-        traverse(path, flag, intro, depth + 1);
-      free(path);
+    /* keep the names of the sub-directories in the order of the listing */
+    size = 0;
+    for (i = 0; i < list->count; i++) {
+      uint32_t index = list->order[i];
+
+      if (S_ISDIR(list->mode[index]) && !is_dot_dir(ENTRY_NAME(list, index)))
+        size += strlen(ENTRY_NAME(list, index)) + 1;
+    }
+    if ((size > 0)
+      && ((frame->names = (char *)arena_alloc(paths, size)) == NULL))
+      err(EXIT_FAILURE, "not enough memory for directory %s", path);
+    size = 0;
+    for (i = 0; i < list->count; i++) {
+      uint32_t index = list->order[i];
+      size_t length;
+
+      if (!S_ISDIR(list->mode[index]) || is_dot_dir(ENTRY_NAME(list, index)))
+        continue;
+      length = strlen(ENTRY_NAME(list, index)) + 1;
+      memcpy(frame->names + size, ENTRY_NAME(list, index), length);
+      size += length;
+      frame->count++;
     }
   }
 
-  free(entries);
+  entries_free(list);
+  arena_reset(arena_scratch());
 }
 
 /*
- * Calls lstat(2) on the given file name and prints the information.
+ * Traverses the given directory according to the flags.
+ * intro determines whether a directory pre-amble should be printed
+ * and depth determines the depth in the traversal relative to
+ * the user-provided directory.
+ * Sub-directories of the R flag are visited depth-first with an explicit
+ * stack, which only holds the names of sub-directories still to be listed,
+ * so memory and stack use do not grow with the sizes of the directories
+ * above the current one.
  */
 static void
-stat_and_print(const char *dir, const char *name, struct flags *flag)
+traverse(const char *dir, struct flags *flag, int intro, int depth)
 {
-  struct file_entry entry;
+  struct dir_frame *stack;
+  struct arena paths;
+  struct arena_mark mark;
+  int stack_size;
+  int top;
+  char *path;
 
-  assert((dir != NULL) && (name != NULL) && (flag != NULL));
+  assert((dir != NULL) && (flag != NULL));
 
-  lstat_path(dir, name, &entry.sb);
-  if (strlen(name) >= sizeof(entry.name))
-    errx(EXIT_FAILURE, "name %s too long", name);
-  strncpy(entry.name, name, sizeof(entry.name));
-  print_entries(dir, &entry, 1, flag);
+  memset(&paths, 0, sizeof(paths));
+  arena_mark(&paths, &mark);
+  if ((path = (char *)arena_alloc(&paths, strlen(dir) + 1)) == NULL)
+    err(EXIT_FAILURE, "not enough memory for directory %s", dir);
+  strcpy(path, dir);
+  stack_size = TRAVERSE_STACK_SIZE;
+  stack = (struct dir_frame *)malloc(sizeof(struct dir_frame) * stack_size);
+  if (stack == NULL)
+    err(EXIT_FAILURE, "not enough memory for directory stack");
+  top = 0;
+  stack[top].mark = mark;
+  list_one(path, flag, intro, depth, &paths, &stack[top]);
+
+  while (top >= 0) {
+    struct dir_frame *frame = &stack[top];
+    char *name;
+
+    if (frame->next == frame->count) {
+      /* all sub-directories are listed */
+      if (flag->Dflag) {
+        usage_report(frame->path, &frame->usage, flag);
+        if (top > 0)
+          usage_add(&stack[top - 1].usage, &frame->usage);
+      }
+      arena_release(&paths, &frame->mark);
+      top--;
+      continue;
+    }
+    name = frame->names + frame->pos;
+    frame->pos += strlen(name) + 1;
+    frame->next++;
+    arena_mark(&paths, &mark);
+    path = arena_path(&paths, frame->path, name);
+
+    if (++top == stack_size) {
+      stack_size *= 2;
+      stack = (struct dir_frame *)realloc(stack,
+        sizeof(struct dir_frame) * stack_size);
+      if (stack == NULL)
+        err(EXIT_FAILURE, "not enough memory for directory stack");
+      frame = &stack[top - 1];
+    }
+    stack[top].mark = mark;
+    list_one(path, flag, intro, frame->depth + 1, &paths, &stack[top]);
+  }
+
+  free(stack);
+  arena_free(&paths);
 }
 
 /*
- * Returns a structure containing the number of files in the given directory
- * and an array of file_entry structures with the entry names and entry
- * lstat(2) values.
- * free(3) the file_entry array contained in the returned structure.
+ * Calls lstat(2) on the given file name and prints the information.
  */
-static struct statdir_info
-statdir(const char *path, struct flags *flag)
+static void
+stat_and_print(const char *dir, const char *name, struct flags *flag)
 {
-  struct statdir_info dir_info;
-  struct file_entry *entries;
-  int entryc;
-  DIR *dir;
-  struct dirent *entry;
-  int displayed;
-  int i;
+  struct entry_list entries;
+  struct stat_request req;
+  struct stat sb;
 
-  entryc = file_count(path);
-  assert(entryc >= 0);
-  entries = (struct file_entry *)malloc(sizeof(struct file_entry) * entryc);
-  if (entries == NULL)
-    err(EXIT_FAILURE, "not enough memory for files names in %s", path);
-
-  if ((dir = opendir(path)) == NULL)
-    err(EXIT_FAILURE, "error opendir %s", path);
-  displayed = 0;
-  for (i = 0; (i < entryc) && ((entry = readdir(dir)) != NULL); i++) {
-    if (display_file(path, entry->d_name, flag)) {
-      if ((strlen(entry->d_name) + 1) > sizeof(entries[displayed].name))
-        errx(EXIT_FAILURE, "file name too long %s", entry->d_name);
-      strcpy(entries[displayed].name, entry->d_name);
-      lstat_path(path, entry->d_name, &entries[displayed].sb);
-      displayed++;
-    }
-  }
+  assert((dir != NULL) && (name != NULL) && (flag != NULL));
 
-  if (closedir(dir) < 0)
-    err(EXIT_FAILURE, "error closedir %s", path);
-  /* was the directory modified during traversal? */
-  if (i < entryc)
-    err(EXIT_FAILURE, "files were removed from directory %s during traversal",
-      path);
-  else if (i > entryc)
-    err(EXIT_FAILURE, "files were added to directory %s during traversal",
-      path);
-
-  dir_info.entry = entries;
-  dir_info.entryc = displayed;
-
-  return dir_info;
+  stat_request_init(&req, flag);
+  lstat_path(dir, AT_FDCWD, name, &req, &sb);
+  entries_init(&entries, req.mask);
+  if (entries_add(&entries, name, sb.st_mode, sb.st_ino) < 0)
+    err(EXIT_FAILURE, "not enough memory for name %s", name);
+  entry_set_stat(&entries, 0, &sb);
+  print_entries(dir, AT_FDCWD, &entries, entries.order, 1, flag);
+  entries_free(&entries);
 }
 
 /*
- * Counts the number of files in the given directory and returns the result.
+ * Returns the positive count of the N flag given by value. Terminates this
+ * process, if the value is not a whole number of 1 to INT_MAX.
  */
 static int
-file_count(const char *path)
+parse_count(const char *value)
 {
-  DIR *dir;
-  int file_c;
-
-  assert (path != NULL);
-
-  if ((dir = opendir(path)) == NULL)
-    err(EXIT_FAILURE, "error opendir %s", path);
-  /* count the number of entries in path */
-  file_c = 0;
-  while (readdir(dir) != NULL)
-    file_c++;
-  if (closedir(dir) < 0)
-    err(EXIT_FAILURE, "error closedir %s", path);
+  long count;
+  char *end;
+
+  errno = 0;
+  count = strtol(value, &end, 10);
+  if ((errno != 0) || (end == value) || (*end != 0) || (count <= 0)
+    || (count > INT_MAX))
+    errx(EXIT_FAILURE, "invalid count %s for the N flag", value);
 
-  return file_c;
+  return (int)count;
 }
 
 /*
- * Adds up the number of blocks in the given directory which are to be
- * displayed.
+ * Returns the number of bytes given by the value of the environment
+ * variable name: a number, optionally followed by K, M or G for KiB, MiB or
+ * GiB. Terminates this process, if the value is malformed.
  */
-static blkcnt_t
-total_blks(const char *dir, struct statdir_info *dir_info, struct flags *flag)
+static size_t
+parse_size(const char *name, const char *value)
 {
-  blkcnt_t total;
-  int i;
-  struct file_entry *entries;
-  int entryc;
-
-  assert ((dir != NULL) && (dir_info != NULL) && (flag != NULL));
-
-  total = 0;
-  entries = dir_info->entry;
-  entryc = dir_info->entryc;
-
-  for (i = 0; i < entryc; i++) {
-    if (display_file(dir, entries[i].name, flag))
-      total += entries[i].sb.st_blocks;
+  unsigned long long size;
+  char *end;
+  int shift;
+
+  errno = 0;
+  size = strtoull(value, &end, 10);
+  if ((errno != 0) || (end == value) || (*value == '-'))
+    errx(EXIT_FAILURE, "invalid %s %s", name, value);
+  switch (*end) {
+  case 'K':
+  case 'k':
+    shift = 10;
+    end++;
+    break;
+  case 'M':
+  case 'm':
+    shift = 20;
+    end++;
+    break;
+  case 'G':
+  case 'g':
+    shift = 30;
+    end++;
+    break;
+  default:
+    shift = 0;
   }
+  if ((*end != 0) || (size > (SIZE_MAX >> shift)))
+    errx(EXIT_FAILURE, "invalid %s %s", name, value);
 
-  return total;
+  return (size_t)size << shift;
 }
 
 /*
@@ -425,7 +603,7 @@ total_blks(const char *dir, struct statdir_info *dir_info, struct flags *flag)
 static void
 usage(void)
 {
-  (void)fprintf(stderr, "usage: %s [−AaCcdFfhiklnqRrSstuwx1][file ...]\n",
-    getprogname());
+  (void)fprintf(stderr, "usage: %s [−AaCcDdFfhiklnqRrSstuWwx1] [-I pattern] "
+    "[-M format] [-N count] [-X pattern] [file ...]\n", getprogname());
   exit(EXIT_FAILURE);
 }
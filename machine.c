@@ -0,0 +1,296 @@
+/*
+ * Machine-readable output (M flag).
+ * Every entry becomes one record of raw fields, written straight to the
+ * output buffer: nothing is padded, no widths are collected beforehand,
+ * and modes, owners and times are not rendered for humans.
+ * The fields are, in this order: the directory as given on the command
+ * line or found by the R flag, the name, the inode number, the mode, the
+ * link count, the owner and group IDs, the size, the device number, the
+ * number of 512 byte blocks, the access, modification and change times in
+ * nanoseconds since the epoch and the target of a symbolic link.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "entries.h"
+#include "machine.h"
+#include "output.h"
+#include "stats.h"
+#include "util.h"
+
+/* room for the longest decimal number with sign */
+#define NUMBER_SIZE 24
+
+/*
+ * Parses the name of a format of the M flag.
+ * Returns 0 on success and -1, if the name is unknown.
+ */
+int
+machine_format_parse(const char *name, enum machine_format *format)
+{
+  assert((name != NULL) && (format != NULL));
+
+  if (strcmp(name, "nul") == 0)
+    *format = MACHINE_NUL;
+  else if (strcmp(name, "json") == 0)
+    *format = MACHINE_JSON;
+  else if (strcmp(name, "bin") == 0)
+    *format = MACHINE_BIN;
+  else
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Writes the decimal digits of value.
+ */
+static void
+put_unsigned(uint64_t value)
+{
+  char buf[NUMBER_SIZE];
+  char *p;
+
+  p = buf + sizeof(buf);
+  do {
+    *--p = '0' + (value % 10);
+    value /= 10;
+  } while (value > 0);
+  output_write(p, buf + sizeof(buf) - p);
+}
+
+/*
+ * Writes the decimal digits of value, preceded by a minus, if negative.
+ */
+static void
+put_signed(int64_t value)
+{
+  if (value < 0) {
+    output_char('-');
+    put_unsigned(-(uint64_t)value);
+  } else
+    put_unsigned(value);
+}
+
+/*
+ * Writes the low size bytes of value, least significant byte first.
+ */
+static void
+put_le(char **p, uint64_t value, int size)
+{
+  int i;
+
+  for (i = 0; i < size; i++) {
+    *(*p)++ = (char)(value & 0xff);
+    value >>= 8;
+  }
+}
+
+/*
+ * Writes s as a JSON string. Bytes which are not ASCII are passed
+ * through, so names which are not UTF-8 stay exact.
+ */
+static void
+put_json_string(const char *s, size_t length)
+{
+  static const char hex[] = "0123456789abcdef";
+  size_t start;
+  size_t i;
+
+  output_char('"');
+  for (start = i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)s[i];
+
+    if ((c >= 0x20) && (c != '"') && (c != '\\'))
+      continue;
+    output_write(s + start, i - start);
+    start = i + 1;
+    if ((c == '"') || (c == '\\')) {
+      output_char('\\');
+      output_char(c);
+    } else {
+      char esc[6] = { '\\', 'u', '0', '0', 0, 0 };
+
+      esc[4] = hex[c >> 4];
+      esc[5] = hex[c & 0xf];
+      output_write(esc, sizeof(esc));
+    }
+  }
+  output_write(s + start, length - start);
+  output_char('"');
+}
+
+/*
+ * Returns the nanoseconds since the epoch of ts.
+ */
+static int64_t
+ns(const struct timespec *ts)
+{
+  return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/*
+ * Stores the target of the symbolic link name relative to dirfd, which has
+ * size bytes according to lstat(2), in a buffer of at least size + 1 bytes
+ * and returns its length.
+ */
+static size_t
+read_target(const char *dir, int dirfd, const char *name, off_t size,
+  char *target)
+{
+  ssize_t r;
+
+  STATS_COUNT(STATS_READLINK, 1);
+  if ((r = readlinkat(dirfd, name, target, size + 1)) < 0)
+    err(EXIT_FAILURE, "readlink error for %s", full_path(dir, name));
+  if (r > size)
+    errx(EXIT_FAILURE, "symlink increased in size between lstat() and "
+      "readlink() for %s", full_path(dir, name));
+
+  return r;
+}
+
+/*
+ * Writes the entries of list with the indices order[0] to order[count - 1]
+ * as records in the format of the M flag. dirfd refers to the directory
+ * dir, which is empty for command line operands.
+ * The list must hold all fields requested by stat_request_init.
+ */
+void
+machine_entries(const char *dir, int dirfd, const struct entry_list *list,
+  const uint32_t *order, int count, struct flags *flag)
+{
+  char *target;
+  size_t target_size;
+  size_t dir_len;
+  int i;
+
+  assert((dir != NULL) && (list != NULL) && ((order != NULL) || (count == 0))
+    && (flag != NULL));
+
+  dir_len = strlen(dir);
+  target = NULL;
+  target_size = 0;
+  for (i = 0; i < count; i++) {
+    uint32_t e = order[i];
+    const char *name = ENTRY_NAME(list, e);
+    size_t name_len = strlen(name);
+    size_t target_len = 0;
+    int64_t times[3];
+    int t;
+
+    if (S_ISLNK(list->mode[e])) {
+      if ((size_t)list->size[e] + 1 > target_size) {
+        target_size = list->size[e] + 1;
+        if ((target = (char *)realloc(target, target_size)) == NULL)
+          err(EXIT_FAILURE, "not enough memory for link target");
+      }
+      target_len = read_target(dir, dirfd, name, list->size[e], target);
+    }
+    times[0] = ns(&list->atime[e]);
+    times[1] = ns(&list->mtime[e]);
+    times[2] = ns(&list->ctime[e]);
+
+    switch (flag->machine) {
+    case MACHINE_NUL:
+      output_write(dir, dir_len + 1);
+      output_write(name, name_len + 1);
+      put_unsigned(list->ino[e]);
+      output_char(0);
+      put_unsigned(list->mode[e]);
+      output_char(0);
+      put_unsigned(list->nlink[e]);
+      output_char(0);
+      put_unsigned(list->uid[e]);
+      output_char(0);
+      put_unsigned(list->gid[e]);
+      output_char(0);
+      put_signed(list->size[e]);
+      output_char(0);
+      put_unsigned(list->rdev[e]);
+      output_char(0);
+      put_signed(list->blocks[e]);
+      output_char(0);
+      for (t = 0; t < 3; t++) {
+        put_signed(times[t]);
+        output_char(0);
+      }
+      if (target_len > 0)
+        output_write(target, target_len);
+      output_char(0);
+      break;
+    case MACHINE_JSON:
+      output_write("{\"dir\":", 7);
+      put_json_string(dir, dir_len);
+      output_write(",\"name\":", 8);
+      put_json_string(name, name_len);
+      output_write(",\"ino\":", 7);
+      put_unsigned(list->ino[e]);
+      output_write(",\"mode\":", 8);
+      put_unsigned(list->mode[e]);
+      output_write(",\"nlink\":", 9);
+      put_unsigned(list->nlink[e]);
+      output_write(",\"uid\":", 7);
+      put_unsigned(list->uid[e]);
+      output_write(",\"gid\":", 7);
+      put_unsigned(list->gid[e]);
+      output_write(",\"size\":", 8);
+      put_signed(list->size[e]);
+      output_write(",\"rdev\":", 8);
+      put_unsigned(list->rdev[e]);
+      output_write(",\"blocks\":", 10);
+      put_signed(list->blocks[e]);
+      output_write(",\"atime\":", 9);
+      put_signed(times[0]);
+      output_write(",\"mtime\":", 9);
+      put_signed(times[1]);
+      output_write(",\"ctime\":", 9);
+      put_signed(times[2]);
+      if (S_ISLNK(list->mode[e])) {
+        output_write(",\"target\":", 10);
+        put_json_string(target, target_len);
+      }
+      output_write("}\n", 2);
+      break;
+    case MACHINE_BIN:
+      {
+        char header[MACHINE_BIN_HEADER];
+        char *p = header;
+
+        put_le(&p, list->ino[e], 8);
+        put_le(&p, list->size[e], 8);
+        put_le(&p, list->blocks[e], 8);
+        put_le(&p, list->rdev[e], 8);
+        for (t = 0; t < 3; t++)
+          put_le(&p, times[t], 8);
+        put_le(&p, list->nlink[e], 8);
+        put_le(&p, list->mode[e], 4);
+        put_le(&p, list->uid[e], 4);
+        put_le(&p, list->gid[e], 4);
+        put_le(&p, dir_len, 2);
+        put_le(&p, name_len, 2);
+        put_le(&p, target_len, 2);
+        assert(p == header + sizeof(header));
+        output_write(header, sizeof(header));
+        output_write(dir, dir_len);
+        output_write(name, name_len);
+        if (target_len > 0)
+          output_write(target, target_len);
+      }
+      break;
+    default:
+      errx(EXIT_FAILURE, "unknown machine format %d", flag->machine);
+    }
+  }
+  free(target);
+}
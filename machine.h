@@ -0,0 +1,33 @@
+#ifndef _MACHINE_H_
+#define _MACHINE_H_
+
+#include <stdint.h>
+
+#include "entries.h"
+
+/* size of the fixed part of a MACHINE_BIN record */
+#define MACHINE_BIN_HEADER 82
+
+/*
+ * Formats of the M flag, which print the raw fields of each entry as one
+ * record instead of aligned text.
+ */
+enum machine_format {
+  MACHINE_NONE,   /* text for humans */
+  MACHINE_NUL,    /* NUL-terminated fields */
+  MACHINE_JSON,   /* JSON Lines */
+  MACHINE_BIN     /* little-endian binary records */
+};
+
+struct flags;
+
+int machine_format_parse(const char *, enum machine_format *);
+#ifdef LIBLS
+/* libls.a only formats text, see libls.c */
+#define machine_entries(dir, dirfd, list, order, entryc, flag) ((void)0)
+#else
+void machine_entries(const char *, int, const struct entry_list *,
+  const uint32_t *, int, struct flags *);
+#endif /* LIBLS */
+
+#endif /* !_MACHINE_H_ */
@@ -0,0 +1,510 @@
+/*
+ * Collects the lstat(2) information of directory entries, either serially,
+ * with a pool of worker threads or with batched io_uring(7) requests.
+ * Network and FUSE file systems answer each request with a round trip, so
+ * many requests in flight hide the latency.
+ * Functions return -1 and set errno on failure.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <linux/io_uring.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "entries.h"
+#include "metadata.h"
+#include "sort.h"
+#include "stats.h"
+#include "util.h"
+
+struct stat_batch {
+  int dirfd;
+  struct entry_list *list;
+  const int *todo;
+  int todoc;
+  const struct stat_request *req;
+  atomic_int next;
+  pthread_mutex_t lock;   /* protects failed and error */
+  int failed;             /* lowest failed position in todo or todoc */
+  int error;
+};
+
+/*
+ * Worker threads wait for a batch, claim chunks of it and report back once
+ * nothing is left to claim. Only one batch is processed at a time.
+ */
+static struct {
+  pthread_mutex_t busy;   /* held while a batch is submitted */
+  pthread_mutex_t lock;   /* protects the fields below */
+  pthread_cond_t work;
+  pthread_cond_t done;
+  struct stat_batch *batch;
+  unsigned long generation;
+  int pending;            /* workers which have not finished the batch */
+  int threads;            /* workers in the pool, -1 if creation failed */
+} pool = {
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  NULL,
+  0,
+  0,
+  0
+};
+
+/*
+ * Submission and completion rings of io_uring(7). A single ring is set up on
+ * first use and shared by all directories, one batch at a time.
+ */
+static struct {
+  pthread_mutex_t busy;   /* held while a batch is processed */
+  int state;              /* 0: not set up, 1: usable, -1: unavailable */
+  int fd;
+  unsigned int depth;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  struct statx *stx;      /* one result buffer per slot */
+  int *slot_pos;          /* position in todo of the request in a slot */
+  int *free_slots;
+} ring = {
+  .busy = PTHREAD_MUTEX_INITIALIZER,
+  .state = 0
+};
+
+/*
+ * Records that the entry at position pos in todo failed with error.
+ */
+static void
+batch_fail(struct stat_batch *batch, int pos, int error)
+{
+  pthread_mutex_lock(&batch->lock);
+  if (pos < batch->failed) {
+    batch->failed = pos;
+    batch->error = error;
+  }
+  pthread_mutex_unlock(&batch->lock);
+}
+
+/*
+ * Stats chunks of the batch until all of them are claimed.
+ */
+static void
+run_batch(struct stat_batch *batch)
+{
+  int start;
+
+  while ((start = atomic_fetch_add(&batch->next, STAT_CHUNK))
+    < batch->todoc) {
+    int end;
+    int i;
+
+    end = start + STAT_CHUNK;
+    if (end > batch->todoc)
+      end = batch->todoc;
+    for (i = start; i < end; i++) {
+      struct stat sb;
+      int index;
+
+      index = batch->todo[i];
+      if (statx_at(batch->dirfd, ENTRY_NAME(batch->list, index), batch->req,
+        &sb) < 0)
+        batch_fail(batch, i, errno);
+      else
+        entry_set_stat(batch->list, index, &sb);
+    }
+  }
+}
+
+/*
+ * Main loop of the pool workers.
+ */
+static void *
+stat_worker(void *arg)
+{
+  unsigned long seen;
+
+  (void)arg;
+  seen = 0;
+  for (;;) {
+    struct stat_batch *batch;
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.generation == seen)
+      pthread_cond_wait(&pool.work, &pool.lock);
+    seen = pool.generation;
+    batch = pool.batch;
+    pthread_mutex_unlock(&pool.lock);
+
+    run_batch(batch);
+
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.pending == 0)
+      pthread_cond_signal(&pool.done);
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  return NULL;
+}
+
+/*
+ * Starts threads - 1 workers; the submitting thread is the last one.
+ * Returns the number of workers started.
+ */
+static int
+pool_start(int threads)
+{
+  int started;
+
+  for (started = 0; started < (threads - 1); started++) {
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, stat_worker, NULL) != 0)
+      break;
+    pthread_detach(tid);
+  }
+
+  return started;
+}
+
+/*
+ * Lets the pool share the batch with the calling thread.
+ * Returns 0 if the pool is in use by another thread or cannot be started,
+ * in which case nothing was done.
+ */
+static int
+pool_run(struct stat_batch *batch, int threads)
+{
+  if (pthread_mutex_trylock(&pool.busy) != 0)
+    return 0;
+  if (pool.threads == 0) {
+    pool.threads = pool_start(threads);
+    if (pool.threads == 0)
+      pool.threads = -1;
+  }
+  if (pool.threads < 0) {
+    pthread_mutex_unlock(&pool.busy);
+    return 0;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.batch = batch;
+  pool.pending = pool.threads;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+
+  run_batch(batch);
+
+  pthread_mutex_lock(&pool.lock);
+  while (pool.pending > 0)
+    pthread_cond_wait(&pool.done, &pool.lock);
+  pool.batch = NULL;
+  pthread_mutex_unlock(&pool.lock);
+  pthread_mutex_unlock(&pool.busy);
+
+  return 1;
+}
+
+/*
+ * Sets up the ring with the given queue depth.
+ * Returns 0 on success and -1 on failure.
+ */
+static int
+ring_setup(unsigned int depth)
+{
+  struct io_uring_params params;
+  char *sq_ptr;
+  char *cq_ptr;
+  size_t sq_len;
+  size_t cq_len;
+  unsigned int i;
+
+  memset(&params, 0, sizeof(params));
+  if ((ring.fd = syscall(__NR_io_uring_setup, depth, &params)) < 0)
+    return -1;
+  sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  cq_len = params.cq_off.cqes
+    + params.cq_entries * sizeof(struct io_uring_cqe);
+  sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+  ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+    IORING_OFF_SQES);
+  if ((sq_ptr == MAP_FAILED) || (cq_ptr == MAP_FAILED)
+    || (ring.sqes == MAP_FAILED)) {
+    close(ring.fd);
+    return -1;
+  }
+
+  ring.sq_head = (unsigned int *)(sq_ptr + params.sq_off.head);
+  ring.sq_tail = (unsigned int *)(sq_ptr + params.sq_off.tail);
+  ring.sq_mask = (unsigned int *)(sq_ptr + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned int *)(sq_ptr + params.sq_off.array);
+  ring.cq_head = (unsigned int *)(cq_ptr + params.cq_off.head);
+  ring.cq_tail = (unsigned int *)(cq_ptr + params.cq_off.tail);
+  ring.cq_mask = (unsigned int *)(cq_ptr + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+
+  ring.depth = params.sq_entries;
+  ring.stx = (struct statx *)malloc(sizeof(struct statx) * ring.depth);
+  ring.slot_pos = (int *)malloc(sizeof(int) * ring.depth);
+  ring.free_slots = (int *)malloc(sizeof(int) * ring.depth);
+  if ((ring.stx == NULL) || (ring.slot_pos == NULL)
+    || (ring.free_slots == NULL)) {
+    close(ring.fd);
+    return -1;
+  }
+  for (i = 0; i < ring.depth; i++)
+    ring.free_slots[i] = i;
+
+  return 0;
+}
+
+/*
+ * Completes a finished request.
+ */
+static void
+ring_complete(struct stat_batch *batch, struct io_uring_cqe *cqe)
+{
+  struct stat sb;
+  int index;
+  int pos;
+
+  pos = ring.slot_pos[cqe->user_data];
+  index = batch->todo[pos];
+  if (cqe->res == 0) {
+    statx_to_stat(&ring.stx[cqe->user_data], &sb);
+    entry_set_stat(batch->list, index, &sb);
+  } else if (cqe->res == -EINVAL) {
+    /* kernels before 5.6 know io_uring(7) but not IORING_OP_STATX */
+    ring.state = -1;
+    if (statx_at(batch->dirfd, ENTRY_NAME(batch->list, index), batch->req,
+      &sb) < 0)
+      batch_fail(batch, pos, errno);
+    else
+      entry_set_stat(batch->list, index, &sb);
+  } else
+    batch_fail(batch, pos, -cqe->res);
+}
+
+/*
+ * Submits IORING_OP_STATX requests for the batch, keeping up to depth of
+ * them in flight, and collects the completions.
+ * Returns 0 if io_uring(7) is not available or is in use by another thread,
+ * in which case nothing was done.
+ */
+static int
+uring_run(struct stat_batch *batch, int depth)
+{
+  unsigned int tail;
+  unsigned int inflight;
+  int nfree;
+  int next;
+
+  if (pthread_mutex_trylock(&ring.busy) != 0)
+    return 0;
+  if (ring.state == 0)
+    ring.state = (ring_setup(depth > 0 ? depth : 1) == 0) ? 1 : -1;
+  if (ring.state < 0) {
+    pthread_mutex_unlock(&ring.busy);
+    return 0;
+  }
+
+  tail = *ring.sq_tail;
+  inflight = 0;
+  nfree = ring.depth;
+  next = 0;
+  while ((next < batch->todoc) || (inflight > 0)) {
+    unsigned int head;
+    unsigned int to_submit;
+
+    /* fill the submission queue */
+    while ((ring.state > 0) && (nfree > 0) && (next < batch->todoc)) {
+      struct io_uring_sqe *sqe;
+      unsigned int index;
+      int slot;
+
+      slot = ring.free_slots[--nfree];
+      ring.slot_pos[slot] = next;
+      index = tail & *ring.sq_mask;
+      sqe = &ring.sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = batch->dirfd;
+      sqe->addr = (uintptr_t)ENTRY_NAME(batch->list, batch->todo[next]);
+      sqe->len = batch->req->mask;
+      sqe->off = (uintptr_t)&ring.stx[slot];
+      sqe->statx_flags = batch->req->flags;
+      sqe->user_data = slot;
+      ring.sq_array[index] = index;
+      STATS_COUNT(STATS_STATX, 1);
+      tail++;
+      next++;
+      inflight++;
+    }
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+    to_submit = tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    STATS_COUNT(STATS_URING_ENTER, 1);
+    if ((syscall(__NR_io_uring_enter, ring.fd, to_submit, 1,
+      IORING_ENTER_GETEVENTS, NULL, 0) < 0) && (errno != EINTR)) {
+      /*
+       * The ring is unusable. Abandon it along with the requests in flight,
+       * which only write to ring.stx, and redo the batch synchronously.
+       */
+      ring.state = -1;
+      batch->failed = batch->todoc;
+      atomic_store(&batch->next, 0);
+      run_batch(batch);
+      break;
+    }
+
+    /* collect completions */
+    head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe;
+
+      cqe = &ring.cqes[head & *ring.cq_mask];
+      ring.free_slots[nfree++] = cqe->user_data;
+      ring_complete(batch, cqe);
+      head++;
+      inflight--;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+    if ((ring.state < 0) && (inflight == 0) && (next < batch->todoc)) {
+      /* finish the rest synchronously */
+      atomic_store(&batch->next, next);
+      run_batch(batch);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ring.busy);
+
+  return 1;
+}
+
+/*
+ * Returns a copy of todo[0] to todo[todoc - 1] ordered by the inode numbers
+ * ino[0] to ino[todoc - 1] of the entries, allocated from the scratch arena.
+ */
+static int *
+inode_order(const int *todo, const uint64_t *ino, int todoc)
+{
+  struct arena *scratch;
+  struct arena_mark mark;
+  uint32_t *order;
+  uint64_t *key;
+  int *sorted;
+  int i;
+
+  scratch = arena_scratch();
+  if ((sorted = (int *)arena_alloc(scratch, sizeof(int) * todoc)) == NULL)
+    return NULL;
+  arena_mark(scratch, &mark);
+  order = (uint32_t *)arena_alloc(scratch, sizeof(uint32_t) * todoc);
+  key = (uint64_t *)arena_alloc(scratch, sizeof(uint64_t) * todoc);
+  if ((order == NULL) || (key == NULL)) {
+    arena_release(scratch, &mark);
+    return NULL;
+  }
+  for (i = 0; i < todoc; i++) {
+    order[i] = todo[i];
+    key[i] = ino[i];
+  }
+  sort_by_key(order, key, todoc);
+  for (i = 0; i < todoc; i++)
+    sorted[i] = order[i];
+  arena_release(scratch, &mark);
+
+  return sorted;
+}
+
+/*
+ * Retrieves the lstat(2) information of the entry with index todo[i] for all
+ * 0 <= i < todoc relative to the directory dirfd, using the backend selected
+ * in flag. Falls back to serial statx(2) calls if the backend is not
+ * available.
+ * ino may be NULL or hold the inode numbers of the directory entries of
+ * todo. Then, from flag->inode_order entries on, they are stat(2)ed by
+ * ascending inode number, which reads inode tables mostly sequentially on
+ * cold caches. Results are stored by index, so the order of the list is
+ * not affected.
+ * Returns 0 on success. Otherwise, returns -1, sets errno and stores the
+ * index of the first entry in todo that failed in failed.
+ */
+int
+stat_entries(int dirfd, struct entry_list *list, const int *todo,
+  const uint64_t *ino, int todoc, const struct stat_request *req,
+  struct flags *flag, int *failed)
+{
+  struct stat_batch batch;
+  struct arena_mark mark;
+  int *sorted;
+  int done;
+
+  assert((list != NULL) && (todo != NULL) && (todoc >= 0)
+    && (req != NULL) && (flag != NULL) && (failed != NULL));
+
+  /* without memory, stat in directory order */
+  arena_mark(arena_scratch(), &mark);
+  sorted = NULL;
+  if ((ino != NULL) && (flag->inode_order > 0)
+    && (todoc >= flag->inode_order)
+    && ((sorted = inode_order(todo, ino, todoc)) != NULL))
+    todo = sorted;
+
+  batch.dirfd = dirfd;
+  batch.list = list;
+  batch.todo = todo;
+  batch.todoc = todoc;
+  batch.req = req;
+  atomic_init(&batch.next, 0);
+  pthread_mutex_init(&batch.lock, NULL);
+  batch.failed = todoc;
+  batch.error = 0;
+
+  done = 0;
+  if ((flag->stat_backend == STAT_URING) && (todoc > 1))
+    done = uring_run(&batch, flag->uring_depth);
+  else if ((flag->stat_backend == STAT_THREADS) && (flag->stat_threads > 1)
+    && (todoc >= (2 * STAT_CHUNK)))
+    done = pool_run(&batch, flag->stat_threads);
+  if (!done)
+    run_batch(&batch);
+  pthread_mutex_destroy(&batch.lock);
+
+  if (batch.failed < todoc) {
+    *failed = todo[batch.failed];
+    arena_release(arena_scratch(), &mark);
+    errno = batch.error;
+    return -1;
+  }
+  arena_release(arena_scratch(), &mark);
+
+  return 0;
+}
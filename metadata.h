@@ -0,0 +1,19 @@
+#ifndef _METADATA_H_
+#define _METADATA_H_
+
+#include <stdint.h>
+
+#include "entries.h"
+#include "util.h"
+
+/* number of entries a stat worker claims at a time */
+#define STAT_CHUNK 64
+/* default number of io_uring(7) requests in flight */
+#define URING_DEPTH 256
+/* default number of entries from which they are stat(2)ed by inode number */
+#define STAT_INODE_ORDER 512
+
+int stat_entries(int, struct entry_list *, const int *, const uint64_t *,
+  int, const struct stat_request *, struct flags *, int *);
+
+#endif /* !_METADATA_H_ */
@@ -0,0 +1,168 @@
+#include <sys/types.h>
+
+#include <assert.h>
+#include <err.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "names.h"
+#include "stats.h"
+
+/*
+ * Cached result of one getpwuid(3) or getgrgid(3) lookup. name is NULL, if
+ * the id has no name, so that failed lookups are not repeated either.
+ */
+struct name_slot {
+  unsigned int id;
+  int used;
+  char *name;
+};
+
+/*
+ * Open addressing hash table from ids to names. It is kept for the whole
+ * process, so that all directories of a listing share it.
+ * Only the printing thread looks names up.
+ */
+struct name_cache {
+  struct name_slot *slots;
+  size_t size;    /* number of slots, a power of two */
+  size_t count;   /* number of used slots */
+};
+
+static struct name_cache users;
+static struct name_cache groups;
+
+/*
+ * Returns the slot of id in cache, which is unused, if id is not cached.
+ */
+static struct name_slot *
+cache_slot(struct name_cache *cache, unsigned int id)
+{
+  size_t i;
+
+  assert((cache != NULL) && (cache->size > 0));
+
+  /* Fibonacci hashing spreads the usually consecutive ids */
+  i = (size_t)((id * UINT32_C(2654435769)) & (cache->size - 1));
+  while (cache->slots[i].used && (cache->slots[i].id != id))
+    i = (i + 1) & (cache->size - 1);
+
+  return &cache->slots[i];
+}
+
+/*
+ * Doubles the number of slots of cache, or allocates the initial slots.
+ */
+static void
+cache_grow(struct name_cache *cache)
+{
+  struct name_slot *old;
+  size_t old_size;
+  size_t i;
+
+  assert(cache != NULL);
+
+  old = cache->slots;
+  old_size = cache->size;
+  cache->size = (old_size == 0) ? NAMES_INIT_SIZE : (old_size * 2);
+  cache->slots = (struct name_slot *)calloc(cache->size,
+    sizeof(struct name_slot));
+  if (cache->slots == NULL)
+    err(EXIT_FAILURE, "not enough memory for the name cache");
+  for (i = 0; i < old_size; i++) {
+    if (old[i].used)
+      *cache_slot(cache, old[i].id) = old[i];
+  }
+  free(old);
+}
+
+/*
+ * Stores name, which may be NULL, for id in cache, unless id is cached
+ * already. Returns the cached name.
+ */
+static const char *
+cache_put(struct name_cache *cache, unsigned int id, const char *name)
+{
+  struct name_slot *slot;
+
+  assert(cache != NULL);
+
+  /* keep the load factor below one half */
+  if ((cache->count + 1) * 2 > cache->size)
+    cache_grow(cache);
+  slot = cache_slot(cache, id);
+  if (slot->used)
+    return slot->name;
+  if ((name != NULL) && ((slot->name = strdup(name)) == NULL))
+    err(EXIT_FAILURE, "not enough memory for name %s", name);
+  slot->id = id;
+  slot->used = 1;
+  cache->count++;
+
+  return slot->name;
+}
+
+/*
+ * Returns the name of the user uid or NULL, if there is none.
+ */
+const char *
+user_name(uid_t uid)
+{
+  struct passwd *pwd;
+
+  if (users.size > 0) {
+    struct name_slot *slot = cache_slot(&users, uid);
+
+    if (slot->used)
+      return slot->name;
+  }
+
+  STATS_COUNT(STATS_USER_LOOKUPS, 1);
+  pwd = getpwuid(uid);
+  return cache_put(&users, uid, (pwd != NULL) ? pwd->pw_name : NULL);
+}
+
+/*
+ * Returns the name of the group gid or NULL, if there is none.
+ */
+const char *
+group_name(gid_t gid)
+{
+  struct group *grp;
+
+  if (groups.size > 0) {
+    struct name_slot *slot = cache_slot(&groups, gid);
+
+    if (slot->used)
+      return slot->name;
+  }
+
+  STATS_COUNT(STATS_GROUP_LOOKUPS, 1);
+  grp = getgrgid(gid);
+  return cache_put(&groups, gid, (grp != NULL) ? grp->gr_name : NULL);
+}
+
+/*
+ * Fills the caches by enumerating the user and group databases once, which
+ * is cheaper than one lookup per id for trees with many owners. The first
+ * entry of an id wins, like with getpwuid(3) and getgrgid(3).
+ */
+void
+names_preload(void)
+{
+  struct passwd *pwd;
+  struct group *grp;
+
+  setpwent();
+  while ((pwd = getpwent()) != NULL)
+    cache_put(&users, pwd->pw_uid, pwd->pw_name);
+  endpwent();
+
+  setgrent();
+  while ((grp = getgrent()) != NULL)
+    cache_put(&groups, grp->gr_gid, grp->gr_name);
+  endgrent();
+}
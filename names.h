@@ -0,0 +1,13 @@
+#ifndef _NAMES_H_
+#define _NAMES_H_
+
+#include <sys/types.h>
+
+/* initial number of slots of each name cache */
+#define NAMES_INIT_SIZE 64
+
+const char *user_name(uid_t);
+const char *group_name(gid_t);
+void names_preload(void);
+
+#endif /* !_NAMES_H_ */
@@ -0,0 +1,175 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "stats.h"
+
+/*
+ * Buffer for standard output. Only the printing thread writes to it.
+ */
+static struct {
+  char buf[OUTPUT_BUF_SIZE];
+  size_t len;
+  int line;      /* flush after each line */
+  int exiting;   /* flushing from output_exit, see write_all */
+} out;
+
+/*
+ * Writes the given buffers to standard output, retrying on partial writes.
+ * No single write(2) call gets more than OUTPUT_CHUNK_SIZE bytes.
+ */
+static void
+write_all(struct iovec *iov, int iovcnt)
+{
+  struct timespec start;
+
+  STATS_START(start);
+  while (iovcnt > 0) {
+    struct iovec chunk[2];
+    size_t total;
+    ssize_t written;
+    int n;
+
+    /* bound the chunk size */
+    total = 0;
+    for (n = 0; (n < iovcnt) && (n < 2) && (total < OUTPUT_CHUNK_SIZE); n++) {
+      chunk[n] = iov[n];
+      if (chunk[n].iov_len > (OUTPUT_CHUNK_SIZE - total))
+        chunk[n].iov_len = OUTPUT_CHUNK_SIZE - total;
+      total += chunk[n].iov_len;
+    }
+
+    STATS_COUNT(STATS_WRITE, 1);
+    if ((written = writev(STDOUT_FILENO, chunk, n)) < 0) {
+      if (errno == EINTR)
+        continue;
+      /* do not write the buffer again from output_flush at exit */
+      out.len = 0;
+      /* exit(3) must not be called again while the process exits */
+      if (out.exiting) {
+        warn("write error");
+        _exit(EXIT_FAILURE);
+      }
+      err(EXIT_FAILURE, "write error");
+    }
+
+    /* skip what was written */
+    while ((iovcnt > 0) && ((size_t)written >= iov->iov_len)) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  STATS_STOP(STATS_OUTPUT, start);
+}
+
+/*
+ * Writes the rest of the buffer when the process exits.
+ */
+static void
+output_exit(void)
+{
+  out.exiting = 1;
+  output_flush();
+}
+
+/*
+ * Sets the flush policy and arranges for the buffer to be written at exit.
+ */
+void
+output_init(enum output_flush flush)
+{
+  if (flush == FLUSH_AUTO)
+    flush = isatty(STDOUT_FILENO) ? FLUSH_LINE : FLUSH_FULL;
+  out.line = (flush == FLUSH_LINE);
+  out.len = 0;
+  out.exiting = 0;
+  if (atexit(output_exit) != 0)
+    errx(EXIT_FAILURE, "cannot register output_exit");
+}
+
+/*
+ * Writes everything that is buffered to standard output.
+ */
+void
+output_flush(void)
+{
+  struct iovec iov;
+
+  if (out.len == 0)
+    return;
+  iov.iov_base = out.buf;
+  iov.iov_len = out.len;
+  out.len = 0;
+  write_all(&iov, 1);
+}
+
+/*
+ * Appends length bytes of data to the output.
+ * Data which does not fit into the buffer is written along with the buffer
+ * in the same writev(2) call.
+ */
+void
+output_write(const char *data, size_t length)
+{
+  assert((data != NULL) || (length == 0));
+
+  if (length <= (OUTPUT_BUF_SIZE - out.len)) {
+    memcpy(out.buf + out.len, data, length);
+    out.len += length;
+  } else {
+    struct iovec iov[2];
+
+    iov[0].iov_base = out.buf;
+    iov[0].iov_len = out.len;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = length;
+    out.len = 0;
+    write_all(iov, 2);
+  }
+}
+
+/*
+ * Appends the character c to the output. Writes the buffer after a newline,
+ * if the output is line buffered.
+ */
+void
+output_char(char c)
+{
+  if (out.len == OUTPUT_BUF_SIZE)
+    output_flush();
+  out.buf[out.len++] = c;
+  if (out.line && (c == '\n'))
+    output_flush();
+}
+
+/*
+ * Appends count spaces to the output.
+ */
+void
+output_pad(size_t count)
+{
+  while (count > 0) {
+    size_t n;
+
+    if (out.len == OUTPUT_BUF_SIZE)
+      output_flush();
+    n = OUTPUT_BUF_SIZE - out.len;
+    if (n > count)
+      n = count;
+    memset(out.buf + out.len, ' ', n);
+    out.len += n;
+    count -= n;
+  }
+}
@@ -0,0 +1,26 @@
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include <stddef.h>
+
+/* size of the output buffer */
+#define OUTPUT_BUF_SIZE (64 * 1024)
+/* maximum number of bytes passed to one write(2) call */
+#define OUTPUT_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * When buffered output is written to standard output.
+ */
+enum output_flush {
+  FLUSH_AUTO,   /* FLUSH_LINE on a terminal and FLUSH_FULL otherwise */
+  FLUSH_LINE,   /* after every line */
+  FLUSH_FULL    /* when the buffer is full */
+};
+
+void output_init(enum output_flush);
+void output_write(const char *, size_t);
+void output_char(char);
+void output_pad(size_t);
+void output_flush(void);
+
+#endif /* !_OUTPUT_H_ */
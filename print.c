@@ -5,15 +5,23 @@
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
-#include <grp.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <bsd/stdlib.h>
 #include <bsd/string.h>
-#include <pwd.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "entries.h"
+#include "machine.h"
+#include "names.h"
+#include "output.h"
+#include "scan.h"
+#include "stats.h"
+#include "timefmt.h"
 #include "util.h"
 #include "print.h"
 
@@ -62,89 +70,105 @@ get_columns(void)
 }
 
 /*
- * The given buffer columns must be DELIMITER-delimited and the buffer must be
- * null-terminated.
- * max determines whether the maximum should be saved.
- * Updates the maximum number of characters per column.
+ * Rows of the current listing. Reused for all listings.
+ */
+static struct rows rows;
+
+static void print_row(struct rows *, int, const short *, int);
+
+/*
+ * Resizes array *p to hold size elements of elem_size bytes each.
  */
 static void
-set_max_per_col(const char *buf, struct max_per_col *dst, int max)
+rows_grow(void *p, size_t elem_size, size_t size)
 {
-  short col;
-  short width;
-  int i;
+  void **array;
 
-  /* find the maximum character width per column */
-  col = 0;
-  width = 0;
-  for (i = 0; (buf[i] != 0) && (col < dst->cols); i++) {
-    if (buf[i] == DELIMITER) {
-      if (!max || (width > dst->max_width[col]))
-        dst->max_width[col] = width;
-      col++;
-      width = 0;
-    } else
-      width++;
-  }
-  if (col == (dst->cols - 1)) {
-    if (!max || (width > dst->max_width[col]))
-      dst->max_width[col] = width;
-  } else
-    errx(EXIT_FAILURE, "entry has more columns than other entries!");
+  array = (void **)p;
+  if ((*array = realloc(*array, elem_size * size)) == NULL)
+    err(EXIT_FAILURE, "not enough memory for formatted rows");
 }
 
 /*
- * Stores the largest given column widths in dst.
+ * Empties rows, keeping the allocated memory.
+ * If keep_widths is set, the maximum field widths are kept as well, so that
+ * the next rows are aligned with the previous ones.
  */
 static void
-set_max(struct max_per_col *dst, struct max_per_col *m1)
+rows_reset(struct rows *r, int keep_widths)
 {
-  int i;
-
-  assert ((dst != NULL) && (m1 != NULL) && (dst->cols == m1->cols));
-
-  for (i = 0; i < dst->cols; i++) {
-    if (m1->max_width[i] > dst->max_width[i])
-      dst->max_width[i] = m1->max_width[i];
-  }
+  r->len = 0;
+  r->count = 0;
+  if (!keep_widths)
+    r->cols = 0;
 }
 
 /*
- * Counts the columns in buffer and stores the result in dst.
- * Allocates memory for dst->max_width which must be free(3)ed.
+ * Appends the given DELIMITER-delimited and null-terminated buffer as a new
+ * row. The field widths of the row are measured while it is copied and the
+ * maximum width per field is updated. Delimiters are found with memchr(3),
+ * which the C library vectorizes.
  */
-void
-init_max_per_col(const char *buf, struct max_per_col *dst)
+static void
+rows_add(struct rows *r, const char *buf)
 {
+  const char *field;
+  const char *delim;
+  const char *end;
+  short *width;
+  short col;
   short cols;
-  int i;
+  size_t length;
+
+  end = buf + strlen(buf);
 
-  cols = 0;
-  /* count columns */
-  for (i = 0; buf[i] != 0; i++) {
-    if (buf[i] == DELIMITER)
+  /* count the columns of the first row */
+  if (r->cols == 0) {
+    cols = 1;
+    for (field = buf; (delim = (const char *)memchr(field, DELIMITER,
+        end - field)) != NULL; field = delim + 1)
       cols++;
+    if (cols > r->cols_size) {
+      rows_grow(&r->max_width, sizeof(short), cols);
+      r->cols_size = cols;
+    }
+    r->cols = cols;
+    memset(r->max_width, 0, sizeof(short) * cols);
   }
-  /* last entry is null-terminated */
-  cols++;
-
-  dst->max_width = (short *)malloc(sizeof(short) * cols);
-  if (dst->max_width == NULL)
-    err(EXIT_FAILURE, "malloc failed for max_width");
-  dst->cols = cols;
 
-  set_max_per_col(buf, dst, 0);
-}
+  if (r->count == r->capacity) {
+    r->capacity = (r->capacity == 0) ? 64 : (r->capacity * 2);
+    rows_grow(&r->start, sizeof(size_t), r->capacity);
+    rows_grow(&r->width, sizeof(short), (size_t)r->capacity * r->cols_size);
+  }
+  length = (end - buf) + 1;
+  if ((r->len + length) > r->size) {
+    r->size = (r->size == 0) ? LINE_SIZE : r->size;
+    while ((r->len + length) > r->size)
+      r->size *= 2;
+    rows_grow(&r->buf, 1, r->size);
+  }
+  memcpy(r->buf + r->len, buf, length);
+  r->start[r->count] = r->len;
+  r->len += length;
 
-/*
- * The given buffer columns must be DELIMITER-delimited and the buffer must be
- * null-terminated.
- * Updates the maximum number of characters per column.
- */
-void
-update_max_per_col(const char *buf, struct max_per_col *dst)
-{
-  set_max_per_col(buf, dst, 1);
+  /* find the character width per column */
+  width = &r->width[(size_t)r->count * r->cols];
+  col = 0;
+  field = buf;
+  while ((col < r->cols) && ((delim = (const char *)memchr(field, DELIMITER,
+      end - field)) != NULL)) {
+    width[col++] = delim - field;
+    field = delim + 1;
+  }
+  if (col != (r->cols - 1))
+    errx(EXIT_FAILURE, "entry has more columns than other entries!");
+  width[col] = end - field;
+  for (col = 0; col < r->cols; col++) {
+    if (width[col] > r->max_width[col])
+      r->max_width[col] = width[col];
+  }
+  r->count++;
 }
 
 /*
@@ -171,6 +195,22 @@ print_delim(char **buf_ptr, size_t *remain)
   print_char(buf_ptr, remain, DELIMITER);
 }
 
+/*
+ * Advances the buffer past the printed characters of snprintf(3), which
+ * returns the untruncated length: at most *remain - 1 characters were
+ * written before the null byte.
+ */
+static void
+print_advance(char **buf_ptr, size_t *remain, int printed)
+{
+  assert((buf_ptr != NULL) && (remain != NULL) && (printed >= 0));
+
+  if ((size_t)printed >= *remain)
+    printed = (*remain > 0) ? (*remain - 1) : 0;
+  *buf_ptr += printed;
+  *remain -= printed;
+}
+
 /*
  * Prints the given provided size in decimal notation. The size is not
  * converted.
@@ -185,8 +225,7 @@ print_size_dec(char **buf_ptr, size_t *remain, unsigned long size)
   printed = snprintf(*buf_ptr, *remain, "%lu", size);
   if (printed < 0)
     errx(EXIT_FAILURE, "print decimal error");
-  *buf_ptr += printed;
-  *remain -= printed;
+  print_advance(buf_ptr, remain, printed);
 }
 
 /*
@@ -226,8 +265,7 @@ print_size_human(char **buf_ptr, size_t *remain, unsigned long size)
   printed = snprintf(*buf_ptr, *remain, "%.*f", fracdigits, result);
   if (printed < 0)
     errx(EXIT_FAILURE, "print size in human-readable format error");
-  *buf_ptr += printed;
-  *remain -= printed;
+  print_advance(buf_ptr, remain, printed);
   if ((unit > 0) && (unit < (sizeof(units) / sizeof(units[0]))))
     print_char(buf_ptr, remain, units[unit]);
 }
@@ -336,14 +374,18 @@ print_type_symbol(char **buf_ptr, size_t *remain, struct stat *sb,
 }
 
 /*
- * Reads the given symbolic link and prints where the link points to.
+ * Reads the given symbolic link relative to dirfd and prints where the link
+ * points to. dir is the path of dirfd and is only used in error messages.
+ * If the link cannot be read, warns, leaves the target out and sets the
+ * exit status in flag, like BSD ls, so that listing and the library in
+ * libls.c go on.
  */
 static void
-print_link(char **buf_ptr, size_t *remain, const char *dir, const char *name,
-  struct stat *sb, struct flags *flag)
+print_link(char **buf_ptr, size_t *remain, const char *dir, int dirfd,
+  const char *name, struct stat *sb, struct flags *flag)
 {
+  char path[PATH_MAX];
   char *linkname;
-  char *path;
   int r;
   int printed;
 
@@ -351,33 +393,38 @@ print_link(char **buf_ptr, size_t *remain, const char *dir, const char *name,
     && (name != NULL) && (sb != NULL) && (flag != NULL));
 
   linkname = (char *)alloca(sb->st_size + 1);
-  path = full_path(dir, name);
-  r = readlink(path, linkname, sb->st_size + 1);
+  STATS_COUNT(STATS_READLINK, 1);
+  r = readlinkat(dirfd, name, linkname, sb->st_size + 1);
+
+  if ((r < 0) || (r > sb->st_size)) {
+    int error = errno;
 
-  if (r < 0)
-    err(EXIT_FAILURE, "readlink error for %s", path);
-  if (r > sb->st_size)
-    errx(EXIT_FAILURE, "symlink increased in size between lstat() and "
-      "readlink() for %s", path);
+    if (path_join(path, dir, name) < 0)
+      strlcpy(path, name, sizeof(path));
+    if (r < 0) {
+      errno = error;
+      warn("readlink error for %s", path);
+    } else
+      /* the first st_size bytes are shown */
+      warnx("symlink increased in size between lstat() and readlink() for "
+        "%s", path);
+    flag->rval = EXIT_FAILURE;
+    if (r < 0)
+      return;
+  }
 
-  linkname[sb->st_size] = 0;
+  linkname[(r > sb->st_size) ? sb->st_size : r] = 0;
   printed = snprintf(*buf_ptr, *remain, " -> %s", linkname);
   if (printed < 0)
     errx(EXIT_FAILURE, "print link error");
-  *buf_ptr += printed;
-  *remain -= printed;
+  print_advance(buf_ptr, remain, printed);
   if (flag->Fflag) {
     struct stat link_sb;
-    const char *link_dir;
-    char *link_path;
 
-    link_dir = (linkname[0] == '/') ? "" : dir;
-    link_path = full_path(link_dir, linkname);
-    if (lstat(link_path, &link_sb) != -1)
+    /* relative link targets are resolved against dirfd */
+    if (fstatat(dirfd, linkname, &link_sb, AT_SYMLINK_NOFOLLOW) != -1)
       print_type_symbol(buf_ptr, remain, &link_sb, flag);
-    free(link_path);
   }
-  free(path);
 }
 
 /*
@@ -391,27 +438,37 @@ print_linkc(char **buf_ptr, size_t *remain, struct stat *sb)
 }
 
 /*
- * Prints the name of the file according to flag.
+ * Prints the name of the file according to flag, replacing non-printable
+ * characters by '?' for the q flag. Runs of printable characters are found
+ * by printable_span and copied at once. Like print_char, truncates the
+ * name to the remaining space.
  */
-static void
+void
 print_name(char **buf_ptr, size_t *remain, const char *name,
   struct flags *flag)
 {
-  int length;
-  int i;
+  size_t length;
+  size_t i;
 
   assert((buf_ptr != NULL) && (remain != NULL) && (name != NULL)
     && (flag != NULL));
 
   length = strlen(name);
-  for (i = 0; i < length; i++) {
-    char c;
-
-    c = name[i];
-    if (flag->qflag && !flag->wflag && !isprint(name[i]))
-      c = '?';
-    print_char(buf_ptr, remain, c);
-  }
+  if (length > *remain)
+    length = *remain;
+  if (flag->qflag && !flag->wflag) {
+    for (i = 0; i < length; i++) {
+      size_t span = printable_span(name + i, length - i);
+
+      memcpy(*buf_ptr + i, name + i, span);
+      i += span;
+      if (i < length)
+        (*buf_ptr)[i] = '?';
+    }
+  } else
+    memcpy(*buf_ptr, name, length);
+  *buf_ptr += length;
+  *remain -= length;
 }
 
 /*
@@ -421,13 +478,13 @@ static void
 print_owner(char **buf_ptr, size_t *remain, struct stat *sb,
   struct flags *flag)
 {
-  struct passwd *pwd;
+  const char *name;
 
   assert((buf_ptr != NULL) && (remain != NULL)
     && (sb != NULL) && (flag != NULL));
 
-  if (!flag->nflag && (pwd = getpwuid(sb->st_uid)) != NULL)
-    print_name(buf_ptr, remain, pwd->pw_name, flag);
+  if (!flag->nflag && (name = user_name(sb->st_uid)) != NULL)
+    print_name(buf_ptr, remain, name, flag);
   else
     print_size_dec(buf_ptr, remain, sb->st_uid);
 }
@@ -439,13 +496,13 @@ static void
 print_group(char **buf_ptr, size_t *remain, struct stat *sb,
   struct flags *flag)
 {
-  struct group *grp;
+  const char *name;
 
   assert((buf_ptr != NULL) && (remain != NULL) && (sb != NULL)
     && (flag != NULL));
 
-  if (!flag->nflag && (grp = getgrgid(sb->st_gid)) != NULL)
-    print_name(buf_ptr, remain, grp->gr_name, flag);
+  if (!flag->nflag && (name = group_name(sb->st_gid)) != NULL)
+    print_name(buf_ptr, remain, name, flag);
   else
     print_size_dec(buf_ptr, remain, sb->st_gid);
 }
@@ -481,11 +538,8 @@ print_size(char **buf_ptr, size_t *remain, struct stat *sb, struct flags *flag)
 static void
 print_time(char **buf_ptr, size_t *remain, struct stat *sb, struct flags *flag)
 {
-  char buf[200];
-  struct tm *tmp;
   time_t tmt;
-  time_t current;
-  int printed;
+  size_t printed;
 
   assert((buf_ptr != NULL) && (remain != NULL) && (sb != NULL) &&
     (flag != NULL));
@@ -497,24 +551,9 @@ print_time(char **buf_ptr, size_t *remain, struct stat *sb, struct flags *flag)
   else
     tmt = sb->st_mtime;
 
-  if (time(&current) < 0)
-    errx(EXIT_FAILURE, "unable to determine current time");
-
-  if ((tmp = localtime(&tmt)) == NULL)
-    errx(EXIT_FAILURE, "localtime error");
-
-  /* Display times older than 6 months with year */
-  if ((current - tmt) < (6 * 30 * 24 * 60 * 60)) {
-    if (strftime(buf, sizeof(buf), "%b %d %H:%M", tmp) == 0)
-      errx(EXIT_FAILURE, "strftime error");
-  } else {
-    if (strftime(buf, sizeof(buf), "%b %d %Y", tmp) == 0)
-      errx(EXIT_FAILURE, "strftime error");
-  }
-
-  printed = snprintf(*buf_ptr, *remain, "%s", buf);
-  if (printed < 0)
-    errx(EXIT_FAILURE, "print time error");
+  if (*remain == 0)
+    return;
+  printed = format_time(*buf_ptr, *remain, tmt);
   *buf_ptr += printed;
   *remain -= printed;
 }
@@ -525,14 +564,17 @@ print_time(char **buf_ptr, size_t *remain, struct stat *sb, struct flags *flag)
 static void
 print_long(char **buf_ptr, size_t *remain, struct stat *sb, struct flags *flag)
 {
+  char mode[12];
+  size_t length;
+
   assert((buf_ptr != NULL) && (remain != NULL) && (sb != NULL)
     && (flag != NULL));
-  /* type and permission */
-  if (*remain < 12)
-    errx(EXIT_FAILURE, "buffer too small to fit mode");
-  strmode(sb->st_mode, *buf_ptr);
-  *buf_ptr += 10;
-  *remain -= 10;
+  /* type and permission, truncated like the other fields */
+  strmode(sb->st_mode, mode);
+  length = (*remain < 10) ? *remain : 10;
+  memcpy(*buf_ptr, mode, length);
+  *buf_ptr += length;
+  *remain -= length;
   print_delim(buf_ptr, remain);
   /* link count */
   print_linkc(buf_ptr, remain, sb);
@@ -558,8 +600,11 @@ void
 print_intro(const char *dir, int intro, int depth, struct flags *flag)
 {
   assert((dir != NULL) && (flag != NULL));
+  /* machine-readable records name their directory */
+  if (flag->machine != MACHINE_NONE)
+    return;
   if (depth > 0)
-    putchar('\n');
+    output_char('\n');
   if (intro || flag->Rflag) {
     char buf[LINE_SIZE];
     char *buf_ptr;
@@ -568,39 +613,215 @@ print_intro(const char *dir, int intro, int depth, struct flags *flag)
     buf_ptr = buf;
     remain = LINE_SIZE;
     print_name(&buf_ptr, &remain, dir, flag);
-    print_char(&buf_ptr, &remain, 0);
-    printf("%s:\n", buf);
+    output_write(buf, buf_ptr - buf);
+    output_write(":", 1);
+    output_char('\n');
+  }
+}
+
+/*
+ * Prints the entry with index i of list as print_file does.
+ */
+static void
+print_entry(char const *buf, size_t buf_size, const char *dir, int dirfd,
+  const struct entry_list *list, int i, struct flags *flag)
+{
+  struct stat sb;
+
+  entry_stat(list, i, &sb);
+  print_file(buf, buf_size, dir, dirfd, ENTRY_NAME(list, i), &sb, flag);
+}
+
+/*
+ * Maximum field widths over ranges of whole blocks of RANGE_BLOCK rows, so
+ * that the widths of a C flag column are found without scanning all of its
+ * entries. Level k holds the maxima of 2^k consecutive blocks.
+ */
+struct range_max {
+  short *table;
+  int blocks;
+  int levels;
+};
+
+/*
+ * Builds the block maxima of the field widths of r in the scratch arena.
+ */
+static void
+range_max_init(struct range_max *rm, struct rows *r)
+{
+  int cols;
+  int b;
+  int i;
+  int j;
+  int k;
+
+  assert((rm != NULL) && (r != NULL));
+
+  cols = r->cols;
+  rm->blocks = (r->count + RANGE_BLOCK - 1) / RANGE_BLOCK;
+  for (rm->levels = 1; (1 << rm->levels) <= rm->blocks; rm->levels++)
+    ;
+  rm->table = (short *)arena_alloc(arena_scratch(),
+    sizeof(short) * rm->levels * rm->blocks * cols);
+  if (rm->table == NULL)
+    err(EXIT_FAILURE, "malloc failed for range_max");
+
+  for (b = 0; b < rm->blocks; b++) {
+    short *max_width = &rm->table[(size_t)b * cols];
+
+    for (j = 0; j < cols; j++)
+      max_width[j] = 1;
+    for (i = b * RANGE_BLOCK; (i < (b + 1) * RANGE_BLOCK) && (i < r->count);
+        i++) {
+      for (j = 0; j < cols; j++) {
+        if (r->width[(size_t)i * cols + j] > max_width[j])
+          max_width[j] = r->width[(size_t)i * cols + j];
+      }
+    }
+  }
+  for (k = 1; k < rm->levels; k++) {
+    for (b = 0; (b + (1 << k)) <= rm->blocks; b++) {
+      short *max_width = &rm->table[((size_t)k * rm->blocks + b) * cols];
+      const short *lo = &rm->table[((size_t)(k - 1) * rm->blocks + b) * cols];
+      const short *hi = lo + (size_t)(1 << (k - 1)) * cols;
+
+      for (j = 0; j < cols; j++)
+        max_width[j] = (lo[j] > hi[j]) ? lo[j] : hi[j];
+    }
+  }
+}
+
+/*
+ * Raises max_width to the field widths of the entries first to last - 1.
+ */
+static void
+scan_max(struct rows *r, int first, int last, int step, short *max_width)
+{
+  int i;
+  int j;
+
+  for (i = first; i < last; i += step) {
+    const short *width = &r->width[(size_t)i * r->cols];
+
+    for (j = 0; j < r->cols; j++) {
+      if (width[j] > max_width[j])
+        max_width[j] = width[j];
+    }
   }
 }
 
+/*
+ * Raises max_width to the field widths of the entries first to last - 1,
+ * using the block maxima rm for the whole blocks in between.
+ */
+static void
+range_max(struct range_max *rm, struct rows *r, int first, int last,
+  short *max_width)
+{
+  const short *lo;
+  const short *hi;
+  int first_block;
+  int last_block;
+  int k;
+  int j;
+
+  first_block = (first + RANGE_BLOCK - 1) / RANGE_BLOCK;
+  last_block = last / RANGE_BLOCK;
+  if (first_block >= last_block) {
+    scan_max(r, first, last, 1, max_width);
+    return;
+  }
+  scan_max(r, first, first_block * RANGE_BLOCK, 1, max_width);
+  scan_max(r, last_block * RANGE_BLOCK, last, 1, max_width);
+  /* two overlapping ranges of 2^k blocks cover the whole blocks */
+  for (k = 0; (2 << k) <= (last_block - first_block); k++)
+    ;
+  lo = &rm->table[((size_t)k * rm->blocks + first_block) * r->cols];
+  hi = &rm->table[((size_t)k * rm->blocks + last_block - (1 << k)) * r->cols];
+  for (j = 0; j < r->cols; j++) {
+    if (lo[j] > max_width[j])
+      max_width[j] = lo[j];
+    if (hi[j] > max_width[j])
+      max_width[j] = hi[j];
+  }
+}
+
+/*
+ * Computes the maximum field widths of each of the ncols output columns of
+ * the layout with nrows rows into max_col_width. Entries go down the columns
+ * for the C flag, which uses the block maxima rm, and across the rows
+ * otherwise.
+ * Returns whether the layout fits into the given number of columns.
+ * Stops early, once the columns seen so far are too wide, unless columns is
+ * negative.
+ */
+static int
+layout_fits(struct rows *r, struct range_max *rm, struct flags *flag,
+  int nrows, int ncols, short *max_col_width, int columns)
+{
+  int entryc;
+  int cols;
+  int chars;
+  int coli;
+
+  assert((r != NULL) && (flag != NULL) && (max_col_width != NULL));
+
+  entryc = r->count;
+  cols = r->cols;
+  chars = -1;
+  for (coli = 0; coli < ncols; coli++) {
+    short *max_width;
+    int j;
+
+    max_width = &max_col_width[coli * cols];
+    for (j = 0; j < cols; j++)
+      max_width[j] = 1;
+    /* the entries of this column */
+    if (flag->Cflag) {
+      int first = coli * nrows;
+      int last = (first + nrows < entryc) ? (first + nrows) : entryc;
+
+      range_max(rm, r, first, last, max_width);
+    } else
+      scan_max(r, coli, entryc, ncols, max_width);
+
+    /* add the column and its delimiting whitespace */
+    for (j = 0; j < cols; j++)
+      chars += max_width[j] + 1;
+    if ((columns >= 0) && (chars > columns))
+      return 0;
+  }
+
+  return 1;
+}
+
 /*
  * Print the directory contents in column mode (C or x flags).
+ * The entries must be formatted into rows already.
  */
 static void
-print_dir(const char *dir, struct file_entry *entries, int entryc,
-  struct flags *flag)
+print_dir(struct rows *r, struct flags *flag)
 {
   int columns;
-  struct max_per_col *entryc_width;
-  struct max_per_col *max_col_width;
+  short *max_col_width;
+  struct arena_mark mark;
+  int entryc;
+  int cols;
   int curr_col;
   int curr_row;
-  int fits;
-  int chars;
+  struct range_max rm;
+  int min_width;
+  int max_width;
+  long max_cols;
   int i;
 
-  entryc_width = (struct max_per_col *)alloca(sizeof(struct max_per_col)
-    * entryc);
-  max_col_width = (struct max_per_col *)alloca(sizeof(struct max_per_col)
-    * entryc);
-
-  assert((dir != NULL) && (entries != NULL) && (flag != NULL));
-  assert(entryc >= 0);
+  assert((r != NULL) && (flag != NULL));
 
   if (!flag->Cflag && !flag->xflag)
     errx(EXIT_FAILURE, "print_dir must be called with either C or x flag set");
 
   /* handle trivial case: zero files */
+  entryc = r->count;
   if (entryc == 0)
     return;
 
@@ -608,73 +829,81 @@ print_dir(const char *dir, struct file_entry *entries, int entryc,
   assert((flag->Cflag || flag->xflag) && !(flag->Cflag && flag->xflag));
   /* get output columns */
   columns = get_columns();
-  /* set column width for each entry */
+  /* maximum field widths of each output column */
+  cols = r->cols;
+  /* the tables only live while printing, see arena_scratch in arena.c */
+  arena_mark(arena_scratch(), &mark);
+  max_col_width = (short *)arena_alloc(arena_scratch(),
+    sizeof(short) * entryc * cols);
+  if (max_col_width == NULL)
+    err(EXIT_FAILURE, "malloc failed for max_col_width");
+
+  /*
+   * Every output column is at least as wide as the narrowest entry and one
+   * of them holds the widest entry. This bounds the number of output
+   * columns which may fit, so layouts with more columns need not be tried.
+   */
+  min_width = -1;
+  max_width = 0;
   for (i = 0; i < entryc; i++) {
-      char buf[LINE_SIZE];
+    int width;
+    int j;
+
+    width = 0;
+    for (j = 0; j < cols; j++) {
+      short w = r->width[(size_t)i * cols + j];
 
-      print_file(buf, LINE_SIZE, dir, entries[i].name, &entries[i].sb, flag);
-      init_max_per_col(buf, &entryc_width[i]);
-      init_max_per_col(buf, &max_col_width[i]);
+      width += (w > 1) ? w : 1;
+    }
+    if ((min_width < 0) || (width < min_width))
+      min_width = width;
+    if (width > max_width)
+      max_width = width;
   }
+  max_cols = ((long)columns + 1 - max_width + min_width) / (min_width + cols);
+  if (max_cols < 1)
+    max_cols = 1;
+  if (max_cols > entryc)
+    max_cols = entryc;
+
   /*
    * If C flag is set: Print entries along columns.
    * Try to iteratively increase row size, until we fit everything.
    *
    * If x flag is set: Print entries along rows and align per column.
    * Try to iteratively decrease column size, until we fit everything.
+   *
+   * Either way, the first layout tried is the one with the most columns
+   * below the bound, so the chosen layout is the same as when trying all
+   * of them. Each try stops at the first column which does not fit.
    */
-  curr_col = entryc;
-  curr_row = 1;
-  do {
-    if (flag->Cflag) {
-      /* we fill rows column-wise, iteratively re-calculating needed columns */
+  if (flag->Cflag) {
+    range_max_init(&rm, r);
+    curr_row = entryc / max_cols;
+    if ((entryc % max_cols) != 0)
+      curr_row++;
+    for (;; curr_row++) {
+      /* we fill rows column-wise, re-calculating needed columns */
       curr_col = entryc / curr_row;
       if ((entryc % curr_row) != 0)
         curr_col++;
-    } else {
-      /* we fill columns row-wise, iteratively re-calculating needed rows */
+      /* we cannot change the format anymore with one row per entry */
+      if (layout_fits(r, &rm, flag, curr_row, curr_col, max_col_width,
+          (curr_row == entryc) ? -1 : columns))
+        break;
+    }
+  } else {
+    for (curr_col = max_cols;; curr_col--) {
+      /* we fill columns row-wise, re-calculating needed rows */
       curr_row = entryc / curr_col;
       if ((entryc % curr_col) != 0)
         curr_row++;
+      /* we cannot change the format anymore with one column */
+      if (layout_fits(r, NULL, flag, curr_row, curr_col, max_col_width,
+          (curr_col == 1) ? -1 : columns))
+        break;
     }
-    /* reset maximum widths */
-    for (i = 0; i < entryc; i++) {
-      int j;
-      for (j = 0; j < max_col_width[i].cols; j++)
-        max_col_width[i].max_width[j] = 1;
-    }
-    /*
-     * Find the maximum size for each column.
-     * Note that each column consists of more than one column, if more than
-     * the file name is to be printed.
-     */
-    for (i = 0; i < entryc; i++) {
-      int coli = flag->Cflag ?  (int)(i / curr_row) : i % curr_col;
-      set_max(&max_col_width[coli], &entryc_width[i]);
-    }
-
-    if ((flag->Cflag && (curr_row == entryc))
-      || (flag->xflag && (curr_col == 1)))
-      /* we cannot change the format anymore */
-      break;
-    /* count maximum space per row */
-    chars = 0;
-    for (i = 0; i < curr_col; i++) {
-      int j;
-      for (j = 0; j < max_col_width[i].cols; j++)
-        chars += max_col_width[i].max_width[j];
-    }
-    /* add whitespace */
-    chars += (curr_col * entryc_width[0].cols) - 1;
-
-    fits = chars <= columns;
-    if (!fits) {
-      if (flag->Cflag)
-        curr_row++;
-      else
-        curr_col--;
-    }
-  } while (!fits);
+  }
 
   /* Do the printing */
   if (flag->Cflag) {
@@ -683,43 +912,34 @@ print_dir(const char *dir, struct file_entry *entries, int entryc,
       for (j = 0; j < curr_col; j++) {
         int p = i + j* curr_row;
         if (p < entryc) {
-          char buf[LINE_SIZE];
           int newline;
 
-          print_file(buf, LINE_SIZE, dir, entries[p].name,
-            &entries[p].sb, flag);
           newline = (j == (curr_col - 1));
-          print_buf(buf, &max_col_width[j], newline);
+          print_row(r, p, &max_col_width[j * cols], newline);
         } else
-          putchar('\n');
+          output_char('\n');
       }
     }
   } else {
     /* x flag set */
     for (i = 0; i < entryc; i++) {
       int coli;
-      char buf[LINE_SIZE];
       int newline;
 
       coli = i % curr_col;
-      print_file(buf, LINE_SIZE, dir, entries[i].name, &entries[i].sb, flag);
       newline = ((coli == (curr_col - 1)) || (i == (entryc - 1)));
-      print_buf(buf, &max_col_width[coli], newline);
+      print_row(r, i, &max_col_width[coli * cols], newline);
     }
   }
-  /* free saved widths */
-  for (i = 0; i < entryc; i++) {
-    free(entryc_width[i].max_width);
-    free(max_col_width[i].max_width);
-  }
+  arena_release(arena_scratch(), &mark);
 }
 
 /*
- * Prints the file as determined by flag.
+ * Prints the file as determined by flag. dirfd refers to the directory dir.
  */
 void
-print_file(char const *buf, size_t buf_size, const char *dir, const char *name,
-  struct stat *sb, struct flags *flag)
+print_file(char const *buf, size_t buf_size, const char *dir, int dirfd,
+  const char *name, struct stat *sb, struct flags *flag)
 {
   char *buf_ptr;
   size_t remain;
@@ -730,13 +950,6 @@ print_file(char const *buf, size_t buf_size, const char *dir, const char *name,
   buf_ptr = (char *)buf;
   remain = buf_size;
 
-  /*
-   * When d flag is set, the function is called on directories that need to be
-   * printed.
-   */
-  if (!flag->dflag && !display_file(dir, name, flag))
-    return;
-
   /* print inode */
   if (flag->iflag) {
     print_inode(&buf_ptr, &remain, sb);
@@ -761,77 +974,118 @@ print_file(char const *buf, size_t buf_size, const char *dir, const char *name,
 
   /* print link target */
   if ((flag->lflag || flag->nflag) && S_ISLNK(sb->st_mode))
-    print_link(&buf_ptr, &remain, dir, name, sb, flag);
+    print_link(&buf_ptr, &remain, dir, dirfd, name, sb, flag);
 
   /* print null byte */
   print_char(&buf_ptr, &remain, 0);
 }
 
 /*
- * Prints the DELIMITER-separated buffer taking into account the given maximum
- * width per column.
+ * Prints the given row, padding each field to the given maximum width per
+ * column.
  */
-void
-print_buf(const char *buf, struct max_per_col *widths, int newline)
+static void
+print_row(struct rows *r, int row, const short *max_width, int newline)
 {
+  const char *field;
+  const short *width;
   short col;
-  short printed;
-  int i;
 
-  col = 0;
-  printed = 0;
-  for (i = 0; (buf[i] != 0) && (col < widths->cols); i++) {
-    if (buf[i] == DELIMITER) {
-      int j;
-      for (j = printed; j < widths->max_width[col]; j++)
-        putchar(' ');
-      /* print delimiting whitespace */
-      putchar(' ');
-      printed = 0;
-      col++;
-    } else {
-      putchar(buf[i]);
-      printed++;
-    }
+  field = r->buf + r->start[row];
+  width = &r->width[(size_t)row * r->cols];
+  for (col = 0; col < (r->cols - 1); col++) {
+    output_write(field, width[col]);
+    /* pad and print delimiting whitespace */
+    output_pad(max_width[col] - width[col] + 1);
+    /* skip the field and its delimiter */
+    field += width[col] + 1;
   }
+  output_write(field, width[col]);
   if (newline)
-    putchar('\n');
-  else if (col == (widths->cols - 1)) {
-    int j;
-    for (j = printed; j < widths->max_width[col]; j++)
-      putchar(' ');
-    /* print delimiting whitespace */
-    putchar(' ');
+    output_char('\n');
+  else {
+    /* pad and print delimiting whitespace */
+    output_pad(max_width[col] - width[col] + 1);
+  }
+}
+
+/*
+ * Formats the entries of list with the indices order[0] to
+ * order[entryc - 1] into rows. See rows_reset for keep_widths.
+ */
+static void
+format_entries(const char *dir, int dirfd, struct entry_list *list,
+  const uint32_t *order, int entryc, struct flags *flag, int keep_widths)
+{
+  char buf[LINE_SIZE];
+  struct timespec start;
+  int i;
+
+  STATS_START(start);
+  rows_reset(&rows, keep_widths);
+  for (i = 0; i < entryc; i++) {
+    print_entry(buf, LINE_SIZE, dir, dirfd, list, order[i], flag);
+    rows_add(&rows, buf);
   }
+  STATS_STOP(STATS_FORMAT, start);
 }
 
 /*
- * Prints the given entries.
+ * Prints the entries of list with the indices order[0] to order[entryc - 1].
+ * dirfd refers to the directory dir.
+ * Each entry is formatted once; the rows are printed afterwards, when the
+ * widths of all fields are known.
  */
 void
-print_entries(const char *dir, struct file_entry *entries, int entryc,
-  struct flags *flag)
+print_entries(const char *dir, int dirfd, struct entry_list *list,
+  const uint32_t *order, int entryc, struct flags *flag)
 {
+  int i;
+
+  if (flag->machine != MACHINE_NONE) {
+    machine_entries(dir, dirfd, list, order, entryc, flag);
+    return;
+  }
+  format_entries(dir, dirfd, list, order, entryc, flag, 0);
   if (flag->Cflag || flag->xflag)
-    print_dir(dir, entries, entryc, flag);
+    print_dir(&rows, flag);
   else {
     /* print line-by-line */
-    struct max_per_col max_widths;
-    char buf[LINE_SIZE];
-    int i;
+    for (i = 0; i < entryc; i++)
+      print_row(&rows, i, rows.max_width, 1);
+  }
+}
 
-    for (i = 0; i < entryc; i++) {
-      print_file(buf, LINE_SIZE, dir, entries[i].name, &entries[i].sb, flag);
-      if (i == 0)
-        init_max_per_col(buf, &max_widths);
-      else
-        update_max_per_col(buf, &max_widths);
-    }
-    for (i = 0; i < entryc; i++) {
-      print_file(buf, LINE_SIZE, dir, entries[i].name, &entries[i].sb, flag);
-      print_buf(buf, &max_widths, 1);
-    }
-    if (entryc >= 1)
-      free(max_widths.max_width);
+/*
+ * Formats the entries of list with the indices order[0] to order[entryc - 1]
+ * like print_batch, but does not print them. Measuring all batches of a
+ * listing first makes print_batch align them all like print_entries.
+ */
+void
+measure_batch(const char *dir, int dirfd, struct entry_list *list,
+  const uint32_t *order, int entryc, struct flags *flag, int first)
+{
+  format_entries(dir, dirfd, list, order, entryc, flag, !first);
+}
+
+/*
+ * Prints the entries of list with the indices order[0] to order[entryc - 1]
+ * line by line, as one batch of a listing which is printed while the
+ * directory is read. first must be set for the first batch.
+ * The fields are as wide as the widest one of this and all previous
+ * batches, so the alignment of later lines may differ.
+ */
+void
+print_batch(const char *dir, int dirfd, struct entry_list *list,
+  const uint32_t *order, int entryc, struct flags *flag, int first)
+{
+  int i;
+
+  if (flag->machine != MACHINE_NONE) {
+    machine_entries(dir, dirfd, list, order, entryc, flag);
+    return;
   }
+  format_entries(dir, dirfd, list, order, entryc, flag, !first);
+  for (i = 0; i < entryc; i++)
+    print_row(&rows, i, rows.max_width, 1);
 }
@@ -4,31 +4,51 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <stdint.h>
 #include <unistd.h>
 
+#include "entries.h"
 #include "util.h"
 
 #define DELIMITER '\b'
 #define PWD_STRING "."
 #define LINE_SIZE 512
 #define TTY_COLUMNS 80
+/* rows per block of the column width maxima of print_dir */
+#define RANGE_BLOCK 32
 #ifndef _S_IFWHT
   #define _S_IFWHT 0160000
 #endif
 
-struct max_per_col {
-  short *max_width;
+/*
+ * Formatted rows of a listing. Every row is formatted exactly once into buf
+ * as DELIMITER-separated fields, and the width of each field is recorded,
+ * so that printing only needs to pad.
+ */
+struct rows {
+  char *buf;
+  size_t len;
+  size_t size;
+  size_t *start;      /* offset of each row in buf */
+  short *width;       /* cols field widths per row */
+  short *max_width;   /* maximum width per field over all rows */
   short cols;
+  short cols_size;
+  int count;
+  int capacity;
 };
 
-void init_max_per_col(const char *, struct max_per_col *);
-void update_max_per_col(const char *, struct max_per_col *);
 void print_char(char **, size_t *, char);
 void print_blks(char **, size_t *, blkcnt_t, struct flags *);
+void print_name(char **, size_t *, const char *, struct flags *);
 void print_intro(const char *, int, int, struct flags *);
-void print_file(char const *, size_t, const char *, const char *,
+void print_file(char const *, size_t, const char *, int, const char *,
 	struct stat *, struct flags *);
-void print_buf(const char *, struct max_per_col *, int);
-void print_entries(const char *, struct file_entry *, int, struct flags *);
+void print_entries(const char *, int, struct entry_list *, const uint32_t *,
+	int, struct flags *);
+void measure_batch(const char *, int, struct entry_list *, const uint32_t *,
+	int, struct flags *, int);
+void print_batch(const char *, int, struct entry_list *, const uint32_t *,
+	int, struct flags *, int);
 
 #endif /* !_PRINT_H_ */
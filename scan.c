@@ -0,0 +1,152 @@
+/*
+ * Vectorized scanning of names for bytes which the q flag replaces.
+ * The kernel is selected once by scan_init from what the processor
+ * supports: AVX2 or SSE2 on x86-64, NEON on AArch64 and a byte loop
+ * everywhere else. Names are printed in the C locale, in which exactly the
+ * bytes 0x20 to 0x7e are printable.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "scan.h"
+
+/*
+ * Adding 0x60 maps the printable bytes 0x20 to 0x7e to 0x80 to 0xde, which
+ * are exactly the signed bytes below -33, so one comparison finds them.
+ */
+#define SHIFT 0x60
+#define LIMIT (-33)
+
+/*
+ * Returns whether c is printable in the C locale.
+ */
+static int
+printable(unsigned char c)
+{
+  return (c >= 0x20) && (c <= 0x7e);
+}
+
+/*
+ * Returns the length of the longest prefix of s[0] to s[n - 1] which only
+ * contains printable bytes, one byte at a time.
+ */
+static size_t
+span_scalar(const char *s, size_t n)
+{
+  size_t i;
+
+  for (i = 0; (i < n) && printable((unsigned char)s[i]); i++)
+    ;
+
+  return i;
+}
+
+#if defined(__x86_64__)
+/*
+ * span_scalar with 16 bytes at a time.
+ */
+static size_t
+span_sse2(const char *s, size_t n)
+{
+  const __m128i shift = _mm_set1_epi8(SHIFT);
+  const __m128i limit = _mm_set1_epi8(LIMIT);
+  size_t i;
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    unsigned int mask = _mm_movemask_epi8(
+      _mm_cmplt_epi8(_mm_add_epi8(v, shift), limit));
+
+    if (mask != 0xffff)
+      return i + __builtin_ctz(~mask);
+  }
+
+  return i + span_scalar(s + i, n - i);
+}
+
+/*
+ * span_scalar with 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static size_t
+span_avx2(const char *s, size_t n)
+{
+  const __m256i shift = _mm256_set1_epi8(SHIFT);
+  const __m256i limit = _mm256_set1_epi8(LIMIT);
+  size_t i;
+
+  for (i = 0; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+      _mm256_cmpgt_epi8(limit, _mm256_add_epi8(v, shift)));
+
+    if (mask != 0xffffffffu)
+      return i + __builtin_ctz(~mask);
+  }
+
+  /* mixing in the legacy SSE kernel would cost state transitions */
+  return i + span_scalar(s + i, n - i);
+}
+#elif defined(__aarch64__)
+/*
+ * span_scalar with 16 bytes at a time.
+ */
+static size_t
+span_neon(const char *s, size_t n)
+{
+  const int8x16_t shift = vdupq_n_s8(SHIFT);
+  const int8x16_t limit = vdupq_n_s8(LIMIT);
+  size_t i;
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    int8x16_t v = vld1q_s8((const int8_t *)(s + i));
+    uint8x16_t ok = vcltq_s8(vaddq_s8(v, shift), limit);
+
+    if (vminvq_u8(ok) != 0xff)
+      break;
+  }
+
+  return i + span_scalar(s + i, n - i);
+}
+#endif
+
+static size_t (*span_fn)(const char *, size_t) = span_scalar;
+
+/*
+ * Selects the fastest kernel this processor supports. Must be called
+ * before other threads are started.
+ */
+void
+scan_init(void)
+{
+#if defined(__x86_64__)
+  /* SSE2 is part of x86-64 */
+  span_fn = span_sse2;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    span_fn = span_avx2;
+#elif defined(__aarch64__)
+  span_fn = span_neon;
+#endif
+}
+
+/*
+ * Returns the length of the longest prefix of s[0] to s[n - 1] which only
+ * contains bytes that are printable in the C locale.
+ */
+size_t
+printable_span(const char *s, size_t n)
+{
+  /* most names are shorter than a vector */
+  if (n < SCAN_MIN)
+    return span_scalar(s, n);
+
+  return span_fn(s, n);
+}
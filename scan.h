@@ -0,0 +1,12 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+
+/* names shorter than this are scanned one byte at a time */
+#define SCAN_MIN 32
+
+void scan_init(void);
+size_t printable_span(const char *, size_t);
+
+#endif /* !_SCAN_H_ */
@@ -0,0 +1,476 @@
+/*
+ * Sorting of entry lists in a single pass per key.
+ * Sizes and times are ordered by a stable LSD radix sort first. Names are
+ * then ordered by a stable merge sort, either as the only key or within
+ * each run of equal sizes or times, so that ties are always broken by name.
+ * The key extraction and the merge sort are generated for each key and
+ * direction and selected once by sort_spec_init, so that no global state is
+ * involved and the inner loops do not branch on the flags.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "arena.h"
+#include "entries.h"
+#include "sort.h"
+
+/*
+ * An entry to sort by name with the case-folded name prefix after the
+ * common prefix of all names, kept next to the index for locality.
+ */
+struct sort_item {
+  uint64_t prefix;
+  uint32_t index;
+};
+
+/*
+ * Names of the entries to sort. All names start with the same skip
+ * characters, ignoring case.
+ */
+struct name_keys {
+  const struct entry_list *list;
+  size_t skip;
+};
+
+/*
+ * Returns the first SORT_PREFIX bytes of name in lower case as a big-endian
+ * number, padded with zero bytes. Comparing prefixes orders names like
+ * strcasecmp(3).
+ */
+static uint64_t
+name_prefix(const char *name)
+{
+  uint64_t prefix;
+  int i;
+
+  prefix = 0;
+  for (i = 0; i < SORT_PREFIX; i++) {
+    unsigned char c = (unsigned char)name[i];
+
+    prefix = (prefix << 8) | (unsigned char)tolower(c);
+    if (c == 0) {
+      prefix <<= 8 * (SORT_PREFIX - 1 - i);
+      break;
+    }
+  }
+
+  return prefix;
+}
+
+/*
+ * Returns the number of leading characters which the names of the entries
+ * order[0] to order[count - 1] have in common, ignoring case.
+ */
+static size_t
+common_prefix(const struct entry_list *list, const uint32_t *order,
+  int count)
+{
+  const char *first;
+  size_t length;
+  int i;
+
+  first = ENTRY_NAME(list, order[0]);
+  length = strlen(first);
+  for (i = 1; (i < count) && (length > 0); i++) {
+    const char *name = ENTRY_NAME(list, order[i]);
+    size_t j;
+
+    for (j = 0; (j < length) && (tolower((unsigned char)name[j])
+        == tolower((unsigned char)first[j])); j++)
+      ;
+    length = j;
+  }
+
+  return length;
+}
+
+/*
+ * Compares the names of the items a and b case-insensitively. Names which
+ * only differ in case are ordered by strcmp(3), so that the order never
+ * depends on the order in the directory.
+ */
+static int
+name_cmp(const struct name_keys *keys, const struct sort_item *a,
+  const struct sort_item *b)
+{
+  const char *n1;
+  const char *n2;
+  int res;
+
+  if (a->prefix != b->prefix)
+    return (a->prefix < b->prefix) ? -1 : 1;
+
+  n1 = ENTRY_NAME(keys->list, a->index);
+  n2 = ENTRY_NAME(keys->list, b->index);
+  if ((res = strcasecmp(n1 + keys->skip, n2 + keys->skip)) == 0)
+    res = strcmp(n1, n2);
+
+  return res;
+}
+
+/*
+ * Defines a function name, which sorts item[0] to item[count - 1] by name
+ * with a bottom-up merge sort. less(keys, a, b) must return whether item a
+ * goes before item b. tmp must have room for count items.
+ */
+#define MERGE_SORT_DEFINE(name, less)                                       \
+static void                                                                 \
+name(const struct name_keys *keys, struct sort_item *item,                  \
+  struct sort_item *tmp, size_t count)                                      \
+{                                                                           \
+  struct sort_item *src;                                                    \
+  struct sort_item *dst;                                                    \
+  size_t width;                                                             \
+  size_t i;                                                                 \
+                                                                            \
+  /* sort short runs by insertion */                                        \
+  for (i = 0; i < count; i += SORT_RUN) {                                   \
+    size_t end = (i + SORT_RUN < count) ? (i + SORT_RUN) : count;           \
+    size_t j;                                                               \
+                                                                            \
+    for (j = i + 1; j < end; j++) {                                         \
+      struct sort_item current = item[j];                                   \
+      size_t k = j;                                                         \
+                                                                            \
+      while ((k > i) && less(keys, &current, &item[k - 1])) {               \
+        item[k] = item[k - 1];                                              \
+        k--;                                                                \
+      }                                                                     \
+      item[k] = current;                                                    \
+    }                                                                       \
+  }                                                                         \
+                                                                            \
+  /* merge runs of doubling width, alternating between the arrays */        \
+  src = item;                                                               \
+  dst = tmp;                                                                \
+  for (width = SORT_RUN; width < count; width *= 2) {                       \
+    for (i = 0; i < count; i += 2 * width) {                                \
+      size_t mid = (i + width < count) ? (i + width) : count;               \
+      size_t end = (i + 2 * width < count) ? (i + 2 * width) : count;       \
+      size_t l = i;                                                         \
+      size_t r = mid;                                                       \
+      size_t k = i;                                                         \
+                                                                            \
+      while ((l < mid) && (r < end)) {                                      \
+        /* take from the left on ties to stay stable */                     \
+        if (less(keys, &src[r], &src[l]))                                   \
+          dst[k++] = src[r++];                                              \
+        else                                                                \
+          dst[k++] = src[l++];                                              \
+      }                                                                     \
+      memcpy(dst + k, src + l, sizeof(struct sort_item) * (mid - l));       \
+      k += mid - l;                                                         \
+      memcpy(dst + k, src + r, sizeof(struct sort_item) * (end - r));       \
+    }                                                                       \
+    src = dst;                                                              \
+    dst = (dst == tmp) ? item : tmp;                                        \
+  }                                                                         \
+  if (src != item)                                                          \
+    memcpy(item, src, sizeof(struct sort_item) * count);                    \
+}
+
+#define NAME_LESS(keys, a, b) (name_cmp((keys), (a), (b)) < 0)
+#define NAME_GREATER(keys, a, b) (name_cmp((keys), (a), (b)) > 0)
+
+MERGE_SORT_DEFINE(merge_sort_asc, NAME_LESS)
+MERGE_SORT_DEFINE(merge_sort_desc, NAME_GREATER)
+
+/*
+ * Sorts order[0] to order[count - 1] by ascending key, where key[p] belongs
+ * to order[p], with a stable LSD radix sort of one byte per pass. Both
+ * arrays are permuted. tmp_order and tmp_key must have room for count
+ * elements.
+ */
+static void
+radix_sort(uint32_t *order, uint64_t *key, uint32_t *tmp_order,
+  uint64_t *tmp_key, size_t count)
+{
+  size_t hist[8][256];
+  uint32_t *result_order;
+  uint64_t *result_key;
+  int byte;
+  size_t i;
+
+  result_order = order;
+  result_key = key;
+
+  /* count all bytes in one go */
+  memset(hist, 0, sizeof(hist));
+  for (i = 0; i < count; i++) {
+    for (byte = 0; byte < 8; byte++)
+      hist[byte][(key[i] >> (8 * byte)) & 0xff]++;
+  }
+
+  for (byte = 0; byte < 8; byte++) {
+    size_t offset[256];
+    size_t sum;
+    uint32_t *swap_order;
+    uint64_t *swap_key;
+    int b;
+
+    /* skip bytes which are the same for all keys, like high time bytes */
+    if (hist[byte][(key[0] >> (8 * byte)) & 0xff] == count)
+      continue;
+    sum = 0;
+    for (b = 0; b < 256; b++) {
+      offset[b] = sum;
+      sum += hist[byte][b];
+    }
+    for (i = 0; i < count; i++) {
+      size_t p = offset[(key[i] >> (8 * byte)) & 0xff]++;
+
+      tmp_order[p] = order[i];
+      tmp_key[p] = key[i];
+    }
+    swap_order = order;
+    order = tmp_order;
+    tmp_order = swap_order;
+    swap_key = key;
+    key = tmp_key;
+    tmp_key = swap_key;
+  }
+  /* after an odd number of passes, the result is in the temporary arrays */
+  if (order != result_order) {
+    memcpy(result_order, order, sizeof(uint32_t) * count);
+    memcpy(result_key, key, sizeof(uint64_t) * count);
+  }
+}
+
+/*
+ * Sorts order[0] to order[count - 1] by ascending key, where key[p] belongs
+ * to order[p], permuting both arrays. Equal keys keep their order.
+ */
+void
+sort_by_key(uint32_t *order, uint64_t *key, int count)
+{
+  struct arena *scratch;
+  struct arena_mark mark;
+  uint32_t *tmp_order;
+  uint64_t *tmp_key;
+
+  assert(((order != NULL) && (key != NULL)) || (count == 0));
+
+  if (count < 2)
+    return;
+  scratch = arena_scratch();
+  arena_mark(scratch, &mark);
+  tmp_order = (uint32_t *)arena_alloc(scratch, sizeof(uint32_t) * count);
+  tmp_key = (uint64_t *)arena_alloc(scratch, sizeof(uint64_t) * count);
+  if ((tmp_order == NULL) || (tmp_key == NULL))
+    err(EXIT_FAILURE, "not enough memory for sorting");
+  radix_sort(order, key, tmp_order, tmp_key, count);
+  arena_release(scratch, &mark);
+}
+
+/*
+ * Defines a function name, which stores the sort keys of the entries
+ * order[0] to order[count - 1] in key, such that ascending keys are largest
+ * values of field first, or smallest values first, if reverse is set.
+ * Signed values are mapped to the order of unsigned keys.
+ */
+#define SORT_KEYS_DEFINE(name, field, reverse)                              \
+static void                                                                 \
+name(const struct entry_list *list, const uint32_t *order, int count,       \
+  uint64_t *key)                                                            \
+{                                                                           \
+  int i;                                                                    \
+                                                                            \
+  for (i = 0; i < count; i++) {                                             \
+    uint64_t value = (uint64_t)(int64_t)list->field ^ (UINT64_C(1) << 63);  \
+                                                                            \
+    key[i] = (reverse) ? value : ~value;                                    \
+  }                                                                         \
+}
+
+SORT_KEYS_DEFINE(keys_size, size[order[i]], 0)
+SORT_KEYS_DEFINE(keys_size_rev, size[order[i]], 1)
+SORT_KEYS_DEFINE(keys_atime, atime[order[i]].tv_sec, 0)
+SORT_KEYS_DEFINE(keys_atime_rev, atime[order[i]].tv_sec, 1)
+SORT_KEYS_DEFINE(keys_mtime, mtime[order[i]].tv_sec, 0)
+SORT_KEYS_DEFINE(keys_mtime_rev, mtime[order[i]].tv_sec, 1)
+SORT_KEYS_DEFINE(keys_ctime, ctime[order[i]].tv_sec, 0)
+SORT_KEYS_DEFINE(keys_ctime_rev, ctime[order[i]].tv_sec, 1)
+
+/*
+ * Key functions and merge sorts by key and direction.
+ */
+static const struct {
+  sort_keys_fn keys;
+  sort_names_fn names;
+} sort_table[][2] = {
+  /* SORT_LEXICO */
+  { { NULL, merge_sort_asc }, { NULL, merge_sort_desc } },
+  /* SORT_SIZE */
+  { { keys_size, merge_sort_asc }, { keys_size_rev, merge_sort_desc } },
+  /* SORT_ATIME */
+  { { keys_atime, merge_sort_asc }, { keys_atime_rev, merge_sort_desc } },
+  /* SORT_MTIME */
+  { { keys_mtime, merge_sort_asc }, { keys_mtime_rev, merge_sort_desc } },
+  /* SORT_CTIME */
+  { { keys_ctime, merge_sort_asc }, { keys_ctime_rev, merge_sort_desc } }
+};
+
+/*
+ * Selects the functions which sort by key, in reverse, if reverse is set.
+ */
+void
+sort_spec_init(struct sort_spec *spec, enum sort_type key, int reverse)
+{
+  assert(spec != NULL);
+
+  if ((key < SORT_LEXICO) || (key > SORT_CTIME))
+    errx(EXIT_FAILURE, "unknown sort key %d", key);
+  spec->keys = sort_table[key][reverse != 0].keys;
+  spec->names = sort_table[key][reverse != 0].names;
+  spec->reverse = reverse != 0;
+}
+
+/*
+ * Sorts order[0] to order[count - 1] by name.
+ */
+static void
+sort_names(const struct sort_spec *spec, const struct name_keys *keys,
+  uint32_t *order, int count, struct sort_item *item, struct sort_item *tmp)
+{
+  int i;
+
+  for (i = 0; i < count; i++) {
+    item[i].index = order[i];
+    item[i].prefix = name_prefix(ENTRY_NAME(keys->list, order[i])
+      + keys->skip);
+  }
+  spec->names(keys, item, tmp, count);
+  for (i = 0; i < count; i++)
+    order[i] = item[i].index;
+}
+
+/*
+ * Sorts the entry indices order[0] to order[count - 1] of list as selected
+ * by spec: by name or by largest size or newest time first and by name
+ * among equal keys, or the reverse of that.
+ * Temporary memory comes from the scratch arena of the calling thread, so
+ * that threads may sort concurrently.
+ */
+void
+sort_order(struct entry_list *list, uint32_t *order, int count,
+  const struct sort_spec *spec)
+{
+  struct name_keys keys;
+  struct arena *scratch;
+  struct arena_mark mark;
+  struct sort_item *item;
+  struct sort_item *tmp;
+
+  assert((list != NULL) && ((order != NULL) || (count == 0))
+    && (spec != NULL));
+
+  if (count < 2)
+    return;
+
+  keys.list = list;
+  keys.skip = common_prefix(list, order, count);
+  scratch = arena_scratch();
+  arena_mark(scratch, &mark);
+  item = (struct sort_item *)arena_alloc(scratch,
+    sizeof(struct sort_item) * count);
+  tmp = (struct sort_item *)arena_alloc(scratch,
+    sizeof(struct sort_item) * count);
+  if ((item == NULL) || (tmp == NULL))
+    err(EXIT_FAILURE, "not enough memory for sorting");
+
+  if (spec->keys == NULL)
+    sort_names(spec, &keys, order, count, item, tmp);
+  else {
+    uint64_t *sort_key;
+    uint64_t *tmp_key;
+    int start;
+    int i;
+
+    sort_key = (uint64_t *)arena_alloc(scratch, sizeof(uint64_t) * count);
+    tmp_key = (uint64_t *)arena_alloc(scratch, sizeof(uint64_t) * count);
+    if ((sort_key == NULL) || (tmp_key == NULL))
+      err(EXIT_FAILURE, "not enough memory for sorting");
+    spec->keys(list, order, count, sort_key);
+    /* the temporary items have room for count indices */
+    radix_sort(order, sort_key, (uint32_t *)tmp, tmp_key, count);
+
+    /* sort each run of equal keys by name */
+    for (start = 0; start < count; start = i) {
+      for (i = start + 1; (i < count) && (sort_key[i] == sort_key[start]);
+          i++)
+        ;
+      if ((i - start) > 1)
+        sort_names(spec, &keys, order + start, i - start, item, tmp);
+    }
+  }
+  arena_release(scratch, &mark);
+}
+
+/*
+ * Compares the entry with index a of list_a and the entry with index b of
+ * list_b in the order selected by spec, like sort_order orders the entries
+ * of one list.
+ */
+int
+sort_compare(const struct entry_list *list_a, uint32_t a,
+  const struct entry_list *list_b, uint32_t b, const struct sort_spec *spec)
+{
+  const char *name_a;
+  const char *name_b;
+  int res;
+
+  assert((list_a != NULL) && (list_b != NULL) && (spec != NULL));
+
+  if (spec->keys != NULL) {
+    uint64_t key_a;
+    uint64_t key_b;
+
+    spec->keys(list_a, &a, 1, &key_a);
+    spec->keys(list_b, &b, 1, &key_b);
+    if (key_a != key_b)
+      return (key_a < key_b) ? -1 : 1;
+  }
+  /* the same order as name_cmp without the prefixes */
+  name_a = ENTRY_NAME(list_a, a);
+  name_b = ENTRY_NAME(list_b, b);
+  if ((res = strcasecmp(name_a, name_b)) == 0)
+    res = strcmp(name_a, name_b);
+
+  return spec->reverse ? -res : res;
+}
+
+/*
+ * Returns the position in the entry indices order[0] to order[count - 1],
+ * sorted by spec, at which the entry with the given index belongs. If the
+ * index is among them, that is its own position, as no two entries of a
+ * directory compare equal.
+ */
+int
+sort_position(const struct entry_list *list, const uint32_t *order,
+  int count, uint32_t index, const struct sort_spec *spec)
+{
+  int low;
+  int high;
+
+  assert((list != NULL) && ((order != NULL) || (count == 0))
+    && (spec != NULL));
+
+  low = 0;
+  high = count;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+
+    if (sort_compare(list, order[middle], list, index, spec) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
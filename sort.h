@@ -0,0 +1,49 @@
+#ifndef _SORT_H_
+#define _SORT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "entries.h"
+
+/* runs shorter than this are sorted by insertion before merging */
+#define SORT_RUN 16
+/* length of the case-folded name prefix compared without strcasecmp(3) */
+#define SORT_PREFIX 8
+
+enum sort_type {
+  SORT_LEXICO,
+  SORT_SIZE,
+  SORT_ATIME,
+  SORT_MTIME,
+  SORT_CTIME
+};
+
+struct name_keys;
+struct sort_item;
+
+typedef void (*sort_keys_fn)(const struct entry_list *, const uint32_t *,
+  int, uint64_t *);
+typedef void (*sort_names_fn)(const struct name_keys *, struct sort_item *,
+  struct sort_item *, size_t);
+
+/*
+ * How to sort, selected once per run by sort_spec_init.
+ * keys is NULL for sorting by name only.
+ */
+struct sort_spec {
+  sort_keys_fn keys;
+  sort_names_fn names;
+  int reverse;
+};
+
+void sort_spec_init(struct sort_spec *, enum sort_type, int);
+void sort_order(struct entry_list *, uint32_t *, int,
+  const struct sort_spec *);
+void sort_by_key(uint32_t *, uint64_t *, int);
+int sort_compare(const struct entry_list *, uint32_t,
+  const struct entry_list *, uint32_t, const struct sort_spec *);
+int sort_position(const struct entry_list *, const uint32_t *, int, uint32_t,
+  const struct sort_spec *);
+
+#endif /* !_SORT_H_ */
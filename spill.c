@@ -0,0 +1,509 @@
+/*
+ * External sorting of directories whose entries exceed the memory budget
+ * set with LS_MEMORY. statdir sorts the entries read so far and writes them
+ * as a run to an unlinked temporary file whenever they exceed the budget.
+ * The printing thread then merges the runs in batches of SPILL_BATCH
+ * entries, holding only one buffer of entries per run. The merge uses the
+ * order of sort_order, so the listing is the same as with all entries in
+ * memory.
+ * Functions return -1 and set errno on failure.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "entries.h"
+#include "sort.h"
+#include "spill.h"
+#include "util.h"
+
+/*
+ * The optional arrays of an entry_list, stored in this order after the
+ * name and mode of each entry.
+ */
+static const struct {
+  unsigned int mask;
+  size_t offset;
+  size_t size;
+} spill_fields[] = {
+  { STATX_INO, offsetof(struct entry_list, ino), sizeof(ino_t) },
+  { STATX_NLINK, offsetof(struct entry_list, nlink), sizeof(nlink_t) },
+  { STATX_UID, offsetof(struct entry_list, uid), sizeof(uid_t) },
+  { STATX_GID, offsetof(struct entry_list, gid), sizeof(gid_t) },
+  { STATX_SIZE, offsetof(struct entry_list, size), sizeof(off_t) },
+  { STATX_SIZE, offsetof(struct entry_list, rdev), sizeof(dev_t) },
+  { STATX_BLOCKS, offsetof(struct entry_list, blocks), sizeof(blkcnt_t) },
+  { STATX_ATIME, offsetof(struct entry_list, atime),
+    sizeof(struct timespec) },
+  { STATX_MTIME, offsetof(struct entry_list, mtime),
+    sizeof(struct timespec) },
+  { STATX_CTIME, offsetof(struct entry_list, ctime), sizeof(struct timespec) }
+};
+
+#define SPILL_FIELDS (sizeof(spill_fields) / sizeof(spill_fields[0]))
+#define FIELD(list, f) (*(char **)((char *)(list) + spill_fields[(f)].offset))
+/* upper bound of the size of one record */
+#define SPILL_RECORD_MAX (sizeof(uint16_t) + NAME_MAX + sizeof(mode_t) \
+  + SPILL_FIELDS * sizeof(struct timespec))
+
+/*
+ * A sorted run of entries in a temporary file. Each record holds the
+ * length of the name, the name without terminating null byte, the mode and
+ * the allocated fields of spill_fields.
+ */
+struct spill_run {
+  int fd;
+  off_t size;                 /* bytes written */
+  off_t pos;                  /* bytes decoded into list */
+  struct entry_list list;     /* entries of the last read */
+  int next;                   /* index of the first unmerged entry of list */
+};
+
+struct spill {
+  struct sort_spec spec;
+  unsigned int fields;
+  size_t field_size;    /* bytes of the fields of a record */
+  struct spill_run *run;
+  int runc;
+  int run_size;
+  int *heap;            /* runs with entries left, smallest first entry on top */
+  int heapc;
+  char *buf;            /* SPILL_BUF bytes for reading runs */
+  char *out;            /* SPILL_BUF bytes for writing a run */
+  long count;
+};
+
+/*
+ * Returns a new, empty set of runs for entries with the given fields.
+ */
+static struct spill *
+spill_new(unsigned int fields, struct flags *flag)
+{
+  struct entry_list probe;
+  struct spill *s;
+  size_t f;
+
+  if ((s = (struct spill *)calloc(1, sizeof(struct spill))) == NULL)
+    return NULL;
+  s->buf = (char *)malloc(SPILL_BUF);
+  s->out = (char *)malloc(SPILL_BUF);
+  if ((s->buf == NULL) || (s->out == NULL)) {
+    free(s->buf);
+    free(s->out);
+    free(s);
+    return NULL;
+  }
+  s->spec = flag->sort;
+  s->fields = fields;
+  /* the stored fields are the arrays which entries_init allocates */
+  entries_init(&probe, fields);
+  for (f = 0; f < SPILL_FIELDS; f++) {
+    if (FIELD(&probe, f) != NULL)
+      s->field_size += spill_fields[f].size;
+  }
+  entries_free(&probe);
+
+  return s;
+}
+
+/*
+ * Returns a descriptor of a new temporary file below flag->spill_dir, which
+ * is gone once it is closed.
+ */
+static int
+spill_open(struct flags *flag)
+{
+  char path[PATH_MAX];
+  int length;
+  int fd;
+
+  if ((fd = open(flag->spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) >= 0)
+    return fd;
+  /* file systems without O_TMPFILE */
+  length = snprintf(path, PATH_MAX, "%s/ls.XXXXXX", flag->spill_dir);
+  if ((length < 0) || (length >= PATH_MAX)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if ((fd = mkostemp(path, O_CLOEXEC)) < 0)
+    return -1;
+  unlink(path);
+
+  return fd;
+}
+
+/*
+ * Writes the size bytes of buf to the end of run.
+ * Returns 0 on success and -1 on failure.
+ */
+static int
+run_write(struct spill_run *run, const char *buf, size_t size)
+{
+  while (size > 0) {
+    ssize_t n;
+
+    if ((n = write(run->fd, buf, size)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += n;
+    size -= n;
+    run->size += n;
+  }
+
+  return 0;
+}
+
+/*
+ * Appends an empty run to s.
+ * Returns the run on success and NULL on failure.
+ */
+static struct spill_run *
+run_new(struct spill *s, struct flags *flag)
+{
+  struct spill_run *run;
+
+  if (s->runc == s->run_size) {
+    int size;
+    struct spill_run *new_run;
+    int *new_heap;
+
+    size = (s->run_size == 0) ? 16 : (2 * s->run_size);
+    if ((new_run = (struct spill_run *)realloc(s->run,
+      sizeof(struct spill_run) * size)) == NULL)
+      return NULL;
+    s->run = new_run;
+    if ((new_heap = (int *)realloc(s->heap, sizeof(int) * size)) == NULL)
+      return NULL;
+    s->heap = new_heap;
+    s->run_size = size;
+  }
+  run = &s->run[s->runc];
+  if ((run->fd = spill_open(flag)) < 0)
+    return NULL;
+  run->size = 0;
+  run->pos = 0;
+  run->next = 0;
+  entries_init(&run->list, s->fields);
+  s->runc++;
+
+  return run;
+}
+
+/*
+ * Appends the entries order[0] to order[count - 1] of list to run.
+ * Returns 0 on success and -1 on failure.
+ */
+static int
+run_append(struct spill *s, struct spill_run *run,
+  const struct entry_list *list, const uint32_t *order, int count)
+{
+  size_t len;
+  int i;
+
+  len = 0;
+  for (i = 0; i < count; i++) {
+    uint32_t index = order[i];
+    const char *name = ENTRY_NAME(list, index);
+    uint16_t length = strlen(name);
+    size_t f;
+
+    if ((SPILL_BUF - len) < SPILL_RECORD_MAX) {
+      if (run_write(run, s->out, len) < 0)
+        return -1;
+      len = 0;
+    }
+    memcpy(s->out + len, &length, sizeof(length));
+    len += sizeof(length);
+    memcpy(s->out + len, name, length);
+    len += length;
+    memcpy(s->out + len, &list->mode[index], sizeof(mode_t));
+    len += sizeof(mode_t);
+    for (f = 0; f < SPILL_FIELDS; f++) {
+      if (FIELD(list, f) != NULL) {
+        memcpy(s->out + len, FIELD(list, f) + index * spill_fields[f].size,
+          spill_fields[f].size);
+        len += spill_fields[f].size;
+      }
+    }
+  }
+
+  return run_write(run, s->out, len);
+}
+
+/*
+ * Merges all runs of s into a single one, so that the number of open files
+ * stays below SPILL_RUNS.
+ * Returns 0 on success and -1 on failure.
+ */
+static int
+spill_merge(struct spill *s, struct flags *flag)
+{
+  struct entry_list batch;
+  struct spill_run *run;
+  int n;
+  int i;
+
+  if ((run = run_new(s, flag)) == NULL)
+    return -1;
+  entries_init(&batch, s->fields);
+  /* the new run is empty, so it takes no part in the merge */
+  if (spill_rewind(s) < 0) {
+    entries_free(&batch);
+    return -1;
+  }
+  while ((n = spill_next(s, &batch)) > 0) {
+    if (run_append(s, run, &batch, batch.order, n) < 0)
+      break;
+  }
+  entries_free(&batch);
+  if (n != 0)
+    return -1;
+
+  for (i = 0; i < (s->runc - 1); i++) {
+    close(s->run[i].fd);
+    entries_free(&s->run[i].list);
+  }
+  s->run[0] = *run;
+  s->runc = 1;
+
+  return 0;
+}
+
+/*
+ * Writes the entries of list in the order of list->order as a new run,
+ * creating the set of runs *sp first, if it is NULL. All lists added to one
+ * set must have the same fields and be sorted by flag->sort.
+ * Returns 0 on success and -1 on failure.
+ */
+int
+spill_add(struct spill **sp, const struct entry_list *list,
+  struct flags *flag)
+{
+  struct spill *s;
+  struct spill_run *run;
+
+  assert((sp != NULL) && (list != NULL) && (flag != NULL));
+
+  if ((*sp == NULL) && ((*sp = spill_new(list->fields, flag)) == NULL))
+    return -1;
+  s = *sp;
+  assert(s->fields == list->fields);
+  if ((s->runc == SPILL_RUNS) && (spill_merge(s, flag) < 0))
+    return -1;
+  if (((run = run_new(s, flag)) == NULL)
+    || (run_append(s, run, list, list->order, list->count) < 0))
+    return -1;
+  s->count += list->count;
+
+  return 0;
+}
+
+/*
+ * Replaces the entries of run->list with the next records of run.
+ * Returns the number of entries read, which is 0 at the end of the run, or
+ * -1 on failure.
+ */
+static int
+run_read(struct spill *s, struct spill_run *run)
+{
+  ssize_t n;
+  size_t pos;
+
+  entries_clear(&run->list);
+  run->next = 0;
+  if (run->pos == run->size)
+    return 0;
+  while ((n = pread(run->fd, s->buf, SPILL_BUF, run->pos)) < 0) {
+    if (errno != EINTR)
+      return -1;
+  }
+
+  for (pos = 0; (pos + sizeof(uint16_t)) <= (size_t)n;) {
+    char name[NAME_MAX + 1];
+    uint16_t length;
+    mode_t mode;
+    const char *p;
+    size_t f;
+    int k;
+
+    memcpy(&length, s->buf + pos, sizeof(length));
+    if ((pos + sizeof(length) + length + sizeof(mode_t) + s->field_size)
+      > (size_t)n)
+      break;
+    p = s->buf + pos + sizeof(length);
+    memcpy(name, p, length);
+    name[length] = 0;
+    p += length;
+    memcpy(&mode, p, sizeof(mode_t));
+    p += sizeof(mode_t);
+    if ((k = entries_add(&run->list, name, mode, 0)) < 0)
+      return -1;
+    for (f = 0; f < SPILL_FIELDS; f++) {
+      if (FIELD(&run->list, f) != NULL) {
+        memcpy(FIELD(&run->list, f) + k * spill_fields[f].size, p,
+          spill_fields[f].size);
+        p += spill_fields[f].size;
+      }
+    }
+    pos = p - s->buf;
+  }
+  if (pos == 0) {
+    /* the file ends within a record */
+    errno = EIO;
+    return -1;
+  }
+  run->pos += pos;
+
+  return run->list.count;
+}
+
+/*
+ * Returns whether the next entry of run number a goes before that of run
+ * number b. Runs are read in the order in which they were written, if
+ * entries compare equal.
+ */
+static int
+run_less(struct spill *s, int a, int b)
+{
+  struct spill_run *run_a = &s->run[a];
+  struct spill_run *run_b = &s->run[b];
+  int res;
+
+  res = sort_compare(&run_a->list, run_a->next, &run_b->list, run_b->next,
+    &s->spec);
+  return (res < 0) || ((res == 0) && (a < b));
+}
+
+/*
+ * Moves the run at position i of the heap down to its place.
+ */
+static void
+heap_down(struct spill *s, int i)
+{
+  for (;;) {
+    int smallest = i;
+    int child = 2 * i + 1;
+    int tmp;
+
+    if ((child < s->heapc) && run_less(s, s->heap[child], s->heap[smallest]))
+      smallest = child;
+    if (((child + 1) < s->heapc)
+      && run_less(s, s->heap[child + 1], s->heap[smallest]))
+      smallest = child + 1;
+    if (smallest == i)
+      return;
+    tmp = s->heap[i];
+    s->heap[i] = s->heap[smallest];
+    s->heap[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+/*
+ * Starts merging the runs from their first entries, so that the merged
+ * entries can be read more than once.
+ * Returns 0 on success and -1 on failure.
+ */
+int
+spill_rewind(struct spill *s)
+{
+  int i;
+
+  assert(s != NULL);
+
+  s->heapc = 0;
+  for (i = 0; i < s->runc; i++) {
+    int n;
+
+    s->run[i].pos = 0;
+    if ((n = run_read(s, &s->run[i])) < 0)
+      return -1;
+    if (n > 0)
+      s->heap[s->heapc++] = i;
+  }
+  for (i = (s->heapc / 2) - 1; i >= 0; i--)
+    heap_down(s, i);
+
+  return 0;
+}
+
+/*
+ * Replaces the entries of batch, which must have the fields of the runs,
+ * with the next at most SPILL_BATCH merged entries, in order.
+ * Returns the number of entries, which is 0 once all are merged, or -1 on
+ * failure.
+ */
+int
+spill_next(struct spill *s, struct entry_list *batch)
+{
+  assert((s != NULL) && (batch != NULL) && (batch->fields == s->fields));
+
+  entries_clear(batch);
+  while ((batch->count < SPILL_BATCH) && (s->heapc > 0)) {
+    struct spill_run *run = &s->run[s->heap[0]];
+    struct stat sb;
+    int k;
+    int n;
+
+    if ((k = entries_add(batch, ENTRY_NAME(&run->list, run->next),
+      run->list.mode[run->next], 0)) < 0)
+      return -1;
+    entry_stat(&run->list, run->next, &sb);
+    entry_set_stat(batch, k, &sb);
+    if (++run->next == run->list.count) {
+      if ((n = run_read(s, run)) < 0)
+        return -1;
+      if (n == 0)
+        s->heap[0] = s->heap[--s->heapc];
+    }
+    heap_down(s, 0);
+  }
+
+  return batch->count;
+}
+
+/*
+ * Returns the number of entries in all runs.
+ */
+long
+spill_count(const struct spill *s)
+{
+  assert(s != NULL);
+  return s->count;
+}
+
+/*
+ * Removes the runs and frees s, which may be NULL.
+ */
+void
+spill_free(struct spill *s)
+{
+  int i;
+
+  if (s == NULL)
+    return;
+  for (i = 0; i < s->runc; i++) {
+    close(s->run[i].fd);
+    entries_free(&s->run[i].list);
+  }
+  free(s->run);
+  free(s->heap);
+  free(s->buf);
+  free(s->out);
+  free(s);
+}
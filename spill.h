@@ -0,0 +1,34 @@
+#ifndef _SPILL_H_
+#define _SPILL_H_
+
+#include "entries.h"
+#include "sort.h"
+#include "util.h"
+
+/* bytes buffered per run while writing or reading it */
+#define SPILL_BUF (64 * 1024)
+/* minimum number of entries per run, however small the budget */
+#define SPILL_MIN 1024
+/* number of runs, and so open files, at which they are merged into one */
+#define SPILL_RUNS 128
+/* maximum number of entries returned at once by spill_next */
+#define SPILL_BATCH 4096
+
+struct spill;
+
+#ifdef LIBLS
+/* libls.a has no memory budget, so nothing is ever spilled */
+#define spill_add(s, list, flag) (-1)
+#define spill_rewind(s) (-1)
+#define spill_next(s, batch) 0
+#define spill_count(s) 0L
+#define spill_free(s) ((void)(s))
+#else
+int spill_add(struct spill **, const struct entry_list *, struct flags *);
+int spill_rewind(struct spill *);
+int spill_next(struct spill *, struct entry_list *);
+long spill_count(const struct spill *);
+void spill_free(struct spill *);
+#endif /* LIBLS */
+
+#endif /* !_SPILL_H_ */
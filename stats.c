@@ -0,0 +1,151 @@
+/*
+ * Counters and phase timings, printed to standard error at exit, if the
+ * LS_STATS environment variable is set. Threads may update them
+ * concurrently.
+ */
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <err.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <bsd/stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+int stats_enabled;
+
+static const char *counter_names[STATS_COUNTERS] = {
+  "directories",
+  "entries",
+  "open",
+  "getdents64",
+  "statx",
+  "io_uring_enter",
+  "readlink",
+  "user lookups",
+  "group lookups",
+  "write"
+};
+
+static const char *phase_names[STATS_PHASES] = {
+  "read",
+  "stat",
+  "sort",
+  "format",
+  "output"
+};
+
+/*
+ * One of the slowest directories to read.
+ */
+struct outlier {
+  long long ns;
+  int entries;
+  char path[PATH_MAX];
+};
+
+static long counters[STATS_COUNTERS];
+static long long phase_ns[STATS_PHASES];
+static struct outlier outliers[STATS_OUTLIERS];
+static pthread_mutex_t outlier_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Returns the nanoseconds from start until now.
+ */
+static long long
+elapsed(const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000LL
+    + (now.tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Prints all counters, timings and the slowest directories.
+ */
+static void
+stats_print(void)
+{
+  int i;
+
+  fprintf(stderr, "%s: stats\n", getprogname());
+  for (i = 0; i < STATS_COUNTERS; i++)
+    fprintf(stderr, "  %-16s %12ld\n", counter_names[i], counters[i]);
+  for (i = 0; i < STATS_PHASES; i++)
+    fprintf(stderr, "  %-16s %12.3f ms\n", phase_names[i],
+      phase_ns[i] / 1e6);
+  if (counters[STATS_DIRS] < 2)
+    return;
+  fprintf(stderr, "  slowest directories\n");
+  for (i = 0; (i < STATS_OUTLIERS) && (outliers[i].ns > 0); i++)
+    fprintf(stderr, "  %12.3f ms %9d entries  %s\n", outliers[i].ns / 1e6,
+      outliers[i].entries, outliers[i].path);
+}
+
+/*
+ * Enables the statistics, if requested, and arranges for them to be
+ * printed at exit.
+ */
+void
+stats_init(void)
+{
+  if (getenv("LS_STATS") == NULL)
+    return;
+  stats_enabled = 1;
+  if (atexit(stats_print) != 0)
+    errx(EXIT_FAILURE, "cannot register stats_print");
+}
+
+/*
+ * Adds n to the given counter.
+ */
+void
+stats_count(enum stats_counter counter, long n)
+{
+  assert((counter >= 0) && (counter < STATS_COUNTERS));
+  __atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Adds the time since start to the given phase.
+ */
+void
+stats_phase(enum stats_phase phase, const struct timespec *start)
+{
+  assert((phase >= 0) && (phase < STATS_PHASES) && (start != NULL));
+  __atomic_fetch_add(&phase_ns[phase], elapsed(start), __ATOMIC_RELAXED);
+}
+
+/*
+ * Records that reading the directory path with the given number of entries
+ * took the time since start, keeping the slowest directories.
+ */
+void
+stats_dir(const char *path, const struct timespec *start, int entries)
+{
+  long long ns;
+  int i;
+
+  assert((path != NULL) && (start != NULL));
+
+  ns = elapsed(start);
+  pthread_mutex_lock(&outlier_lock);
+  for (i = 0; (i < STATS_OUTLIERS) && (outliers[i].ns >= ns); i++)
+    ;
+  if (i < STATS_OUTLIERS) {
+    memmove(&outliers[i + 1], &outliers[i],
+      sizeof(struct outlier) * (STATS_OUTLIERS - 1 - i));
+    outliers[i].ns = ns;
+    outliers[i].entries = entries;
+    strncpy(outliers[i].path, path, sizeof(outliers[i].path) - 1);
+    outliers[i].path[sizeof(outliers[i].path) - 1] = 0;
+  }
+  pthread_mutex_unlock(&outlier_lock);
+}
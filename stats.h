@@ -0,0 +1,65 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <time.h>
+
+/* number of slowest directories reported */
+#define STATS_OUTLIERS 5
+
+enum stats_counter {
+  STATS_DIRS,
+  STATS_ENTRIES,
+  STATS_OPEN,
+  STATS_GETDENTS,
+  STATS_STATX,
+  STATS_URING_ENTER,
+  STATS_READLINK,
+  STATS_USER_LOOKUPS,
+  STATS_GROUP_LOOKUPS,
+  STATS_WRITE,
+  STATS_COUNTERS
+};
+
+enum stats_phase {
+  STATS_READ,
+  STATS_STAT,
+  STATS_SORT,
+  STATS_FORMAT,
+  STATS_OUTPUT,
+  STATS_PHASES
+};
+
+#ifdef LIBLS
+/* libls.a leaves the statistics out, see the Makefile */
+#define STATS_COUNT(counter, n) do { } while (0)
+#define STATS_START(clock) ((void)&(clock))
+#define STATS_STOP(phase, clock) ((void)&(clock))
+#define STATS_DIR(path, clock, entries) ((void)&(clock))
+#else
+/* set by stats_init; nothing else is done unless it is set */
+extern int stats_enabled;
+
+#define STATS_COUNT(counter, n) do {                                        \
+    if (stats_enabled)                                                      \
+      stats_count((counter), (n));                                          \
+  } while (0)
+#define STATS_START(clock) do {                                             \
+    if (stats_enabled)                                                      \
+      clock_gettime(CLOCK_MONOTONIC, &(clock));                             \
+  } while (0)
+#define STATS_STOP(phase, clock) do {                                       \
+    if (stats_enabled)                                                      \
+      stats_phase((phase), &(clock));                                       \
+  } while (0)
+#define STATS_DIR(path, clock, entries) do {                                \
+    if (stats_enabled)                                                      \
+      stats_dir((path), &(clock), (entries));                               \
+  } while (0)
+
+void stats_init(void);
+void stats_count(enum stats_counter, long);
+void stats_phase(enum stats_phase, const struct timespec *);
+void stats_dir(const char *, const struct timespec *, int);
+#endif /* LIBLS */
+
+#endif /* !_STATS_H_ */
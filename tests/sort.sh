@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Checks the sorting of ls on a generated directory with many ties in size
+# and time and names which differ only in case: every listing must be the
+# same whether the entries are sorted in memory or spilled to temporary
+# files beyond an LS_MEMORY budget (see spill.c), and the r flag must
+# reverse the order of the radix and merge sort of sort.c exactly.
+# Usage: sh tests/sort.sh [ls]
+
+set -e
+
+LS=${1:-./ls}
+COUNT=${SORT_COUNT:-5000}
+dir=$(mktemp -d "${TMPDIR:-/tmp}/ls-sort.XXXXXX")
+trap 'rm -rf "$dir" "$dir.names" "$dir.mem" "$dir.spill"' EXIT INT TERM
+
+# names in several cases and with punctuation around the letters
+awk -v n="$COUNT" 'BEGIN {
+  split("a A _a ab AB Ab .a a. [a a~", p, " ");
+  for (i = 0; i < n; i++)
+    printf "%s%d\n", p[i % 10 + 1], int(i / 10);
+}' > "$dir.names"
+cd "$dir"
+# 7 sizes and 5 modification times, so that most entries tie
+for k in 0 1 2 3 4 5 6; do
+  awk -v k=$k 'NR % 7 == k' "$dir.names" | xargs touch
+  awk -v k=$k 'NR % 7 == k' "$dir.names" | xargs truncate -s $((k * 1000))
+done
+for k in 1 2 3 4 5; do
+  awk -v k=$k 'NR % 5 == k - 1' "$dir.names" \
+    | xargs touch -m -d "2020-01-0$k 12:00:00"
+done
+cd - > /dev/null
+rm "$dir.names"
+
+failures=0
+fail() {
+  echo "FAIL: $*" >&2
+  failures=$((failures + 1))
+}
+
+for args in -1 -1r -1t -1tr -1S -1Sr -1tu -1f -1a -1ar -l -lS -lt -ls; do
+  "$LS" $args "$dir" > "$dir.mem"
+  LS_MEMORY=1K "$LS" $args "$dir" > "$dir.spill"
+  cmp -s "$dir.mem" "$dir.spill" || fail "LS_MEMORY=1K ls $args"
+done
+for args in -1 -1t -1S -1a; do
+  "$LS" $args "$dir" | tac > "$dir.mem"
+  "$LS" ${args}r "$dir" > "$dir.spill"
+  cmp -s "$dir.mem" "$dir.spill" || fail "ls ${args}r is not ls $args reversed"
+done
+
+if [ $failures -gt 0 ]; then
+  echo "$failures failures" >&2
+  exit 1
+fi
+echo "sort: all listings match"
@@ -0,0 +1,231 @@
+#include <assert.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "timefmt.h"
+
+#define SECS_PER_HOUR (60 * 60)
+#define SECS_PER_DAY (24 * SECS_PER_HOUR)
+/* times older than this are displayed with the year instead of the time */
+#define SIX_MONTHS (6 * 30 * SECS_PER_DAY)
+
+/*
+ * UTC offset of the local time zone during one hour.
+ */
+struct offset_slot {
+  long long hour;   /* hours since the epoch */
+  long offset;      /* seconds east of UTC */
+  int valid;
+};
+
+/*
+ * State of the formatter, computed once per process.
+ * Only the printing thread formats times.
+ */
+static struct {
+  int initialized;
+  time_t now;
+  char months[12][TIMEFMT_SIZE];
+  size_t month_len[12];
+  struct offset_slot offsets[TIMEFMT_CACHE_SIZE];
+} fmt;
+
+/*
+ * Determines the current time and the month names of the current locale.
+ */
+static void
+format_init(void)
+{
+  int i;
+
+  if (time(&fmt.now) < 0)
+    errx(EXIT_FAILURE, "unable to determine current time");
+  for (i = 0; i < 12; i++) {
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_mon = i;
+    tm.tm_mday = 1;
+    tm.tm_year = 70;
+    fmt.month_len[i] = strftime(fmt.months[i], sizeof(fmt.months[i]), "%b",
+      &tm);
+    if (fmt.month_len[i] == 0)
+      errx(EXIT_FAILURE, "strftime error");
+  }
+  fmt.initialized = 1;
+}
+
+/*
+ * Takes the current time again, from which the six months of
+ * format_time are counted, so that processes which format times for long,
+ * such as users of libls.c, do not drift. Keeps the previous time, if the
+ * current one cannot be determined.
+ */
+void
+format_refresh(void)
+{
+  time_t now;
+
+  if (!fmt.initialized)
+    format_init();
+  else if (time(&now) >= 0)
+    fmt.now = now;
+}
+
+/*
+ * Returns the floor of a / b for b > 0.
+ */
+static long long
+floor_div(long long a, long long b)
+{
+  return (a >= 0) ? (a / b) : -((b - 1 - a) / b);
+}
+
+/*
+ * Looks up the UTC offset which applies at time t.
+ * The offset is computed with localtime_r(3) once per hour and only cached,
+ * if it does not change within that hour. Returns 0 on success and -1, if
+ * localtime_r must be used for t.
+ */
+static int
+utc_offset(time_t t, long *offset)
+{
+  struct offset_slot *slot;
+  struct tm first;
+  struct tm last;
+  long long hour;
+  time_t start;
+
+  hour = floor_div(t, SECS_PER_HOUR);
+  slot = &fmt.offsets[(size_t)hour & (TIMEFMT_CACHE_SIZE - 1)];
+  if (!slot->valid || (slot->hour != hour)) {
+    start = (time_t)(hour * SECS_PER_HOUR);
+    if ((localtime_r(&start, &first) == NULL))
+      return -1;
+    start += SECS_PER_HOUR - 1;
+    if ((localtime_r(&start, &last) == NULL)
+      || (first.tm_gmtoff != last.tm_gmtoff))
+      return -1;
+    slot->hour = hour;
+    slot->offset = first.tm_gmtoff;
+    slot->valid = 1;
+  }
+  *offset = slot->offset;
+
+  return 0;
+}
+
+/*
+ * Breaks the local time t down into tm, just like localtime(3).
+ * Only the date, the hour and the minute are set.
+ */
+static void
+local_time(time_t t, struct tm *tm)
+{
+  long long days;
+  long long secs;
+  long long era;
+  long long doe;
+  long long yoe;
+  long long doy;
+  long long mp;
+  long long year;
+  long offset;
+
+  if (utc_offset(t, &offset) < 0) {
+    if (localtime_r(&t, tm) == NULL)
+      errx(EXIT_FAILURE, "localtime error");
+    return;
+  }
+
+  secs = (long long)t + offset;
+  days = floor_div(secs, SECS_PER_DAY);
+  secs -= days * SECS_PER_DAY;
+  tm->tm_hour = (int)(secs / SECS_PER_HOUR);
+  tm->tm_min = (int)((secs % SECS_PER_HOUR) / 60);
+
+  /* civil date from days since 1970-01-01, in eras of 400 years */
+  days += 719468;
+  era = floor_div(days, 146097);
+  doe = days - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  tm->tm_mday = (int)(doy - (153 * mp + 2) / 5 + 1);
+  tm->tm_mon = (int)((mp < 10) ? (mp + 2) : (mp - 10));
+  year = yoe + era * 400 + (tm->tm_mon <= 1);
+  tm->tm_year = (int)(year - 1900);
+}
+
+/*
+ * Appends the two-digit decimal number n to buf.
+ */
+static char *
+put_two(char *buf, int n)
+{
+  buf[0] = '0' + n / 10;
+  buf[1] = '0' + n % 10;
+  return buf + 2;
+}
+
+/*
+ * Formats t like strftime(3) with "%b %d %H:%M" for times of the last six
+ * months and with "%b %d %Y" for older times into buf of the given size.
+ * Returns the length of the result without the terminating null byte.
+ */
+size_t
+format_time(char *buf, size_t size, time_t t)
+{
+  char tmp[2 * TIMEFMT_SIZE];
+  char *p;
+  struct tm tm;
+  size_t length;
+
+  assert((buf != NULL) && (size > 0));
+
+  if (!fmt.initialized)
+    format_init();
+  local_time(t, &tm);
+
+  p = tmp;
+  memcpy(p, fmt.months[tm.tm_mon], fmt.month_len[tm.tm_mon]);
+  p += fmt.month_len[tm.tm_mon];
+  *p++ = ' ';
+  p = put_two(p, tm.tm_mday);
+  *p++ = ' ';
+  if ((fmt.now - t) < SIX_MONTHS) {
+    p = put_two(p, tm.tm_hour);
+    *p++ = ':';
+    p = put_two(p, tm.tm_min);
+  } else {
+    char digits[16];
+    long long year;
+    int negative;
+    int n;
+
+    year = (long long)tm.tm_year + 1900;
+    negative = year < 0;
+    if (negative)
+      year = -year;
+    n = 0;
+    do {
+      digits[n++] = '0' + (char)(year % 10);
+      year /= 10;
+    } while (year > 0);
+    if (negative)
+      *p++ = '-';
+    while (n > 0)
+      *p++ = digits[--n];
+  }
+
+  length = p - tmp;
+  if (length >= size)
+    length = size - 1;
+  memcpy(buf, tmp, length);
+  buf[length] = 0;
+
+  return length;
+}
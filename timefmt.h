@@ -0,0 +1,16 @@
+#ifndef _TIMEFMT_H_
+#define _TIMEFMT_H_
+
+#include <stddef.h>
+#include <time.h>
+
+/* number of hours whose UTC offsets are cached */
+#define TIMEFMT_CACHE_SIZE 256
+
+/* large enough for any formatted time */
+#define TIMEFMT_SIZE 64
+
+size_t format_time(char *, size_t, time_t);
+void format_refresh(void);
+
+#endif /* !_TIMEFMT_H_ */
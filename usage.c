@@ -0,0 +1,251 @@
+/*
+ * Cumulative disk usage of directories (D flag), gathered from the
+ * metadata which the R traversal collects anyway.
+ * Each directory sums up itself and its entries other than directories,
+ * which count themselves once they are read. Files with several links are
+ * counted once per run, by keeping their device and inode numbers in a set
+ * of independently locked parts, so that the walk workers may sum up
+ * directories concurrently. The traversal adds the sums of subdirectories
+ * to their parents bottom-up, once their subtrees are done, and reports
+ * them in that order, as du(1) does.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "entries.h"
+#include "output.h"
+#include "print.h"
+#include "usage.h"
+#include "util.h"
+
+/*
+ * A file with several links. Slots with inode number 0 are free.
+ */
+struct file_id {
+  dev_t dev;
+  ino_t ino;
+};
+
+/*
+ * Part of the set of files with several links, an open addressing table.
+ */
+static struct stripe {
+  pthread_mutex_t lock;
+  struct file_id *slot;
+  size_t size;
+  size_t count;
+} stripes[USAGE_STRIPES];
+
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+/* report lines in the order in which the directories were completed */
+static struct {
+  char *buf;
+  size_t len;
+  size_t size;
+} report;
+
+/*
+ * Initializes the locks of the parts of the set.
+ */
+static void
+stripes_init(void)
+{
+  int i;
+
+  for (i = 0; i < USAGE_STRIPES; i++)
+    pthread_mutex_init(&stripes[i].lock, NULL);
+}
+
+/*
+ * Returns a hash of the given file.
+ */
+static uint64_t
+file_hash(dev_t dev, ino_t ino)
+{
+  uint64_t hash;
+
+  /* mixing step of splitmix64 */
+  hash = ((uint64_t)ino ^ ((uint64_t)dev << 32)) + 0x9e3779b97f4a7c15ULL;
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+
+  return hash ^ (hash >> 31);
+}
+
+/*
+ * Returns the free slot for the file or NULL, if it is in the table. The
+ * lock of the stripe must be held.
+ */
+static struct file_id *
+stripe_find(struct stripe *s, uint64_t hash, dev_t dev, ino_t ino)
+{
+  size_t mask;
+  size_t i;
+
+  mask = s->size - 1;
+  for (i = (hash >> 8) & mask; s->slot[i].ino != 0; i = (i + 1) & mask) {
+    if ((s->slot[i].ino == ino) && (s->slot[i].dev == dev))
+      return NULL;
+  }
+
+  return &s->slot[i];
+}
+
+/*
+ * Doubles the size of the table of the stripe. The lock must be held.
+ */
+static void
+stripe_grow(struct stripe *s)
+{
+  struct file_id *old;
+  size_t old_size;
+  size_t i;
+
+  old = s->slot;
+  old_size = s->size;
+  s->size = (old_size == 0) ? USAGE_STRIPE_SIZE : (old_size * 2);
+  if ((s->slot = (struct file_id *)calloc(s->size, sizeof(struct file_id)))
+    == NULL)
+    err(EXIT_FAILURE, "not enough memory for hard links");
+  for (i = 0; i < old_size; i++) {
+    if (old[i].ino != 0)
+      *stripe_find(s, file_hash(old[i].dev, old[i].ino), old[i].dev,
+        old[i].ino) = old[i];
+  }
+  free(old);
+}
+
+/*
+ * Adds the file to the set. Returns whether it was not in the set before.
+ * Threads may call this concurrently.
+ */
+static int
+file_first_seen(dev_t dev, ino_t ino)
+{
+  struct stripe *s;
+  struct file_id *slot;
+  uint64_t hash;
+
+  pthread_once(&stripes_once, stripes_init);
+  hash = file_hash(dev, ino);
+  s = &stripes[hash % USAGE_STRIPES];
+  pthread_mutex_lock(&s->lock);
+  if ((s->count + 1) * 2 > s->size)
+    stripe_grow(s);
+  if ((slot = stripe_find(s, hash, dev, ino)) != NULL) {
+    slot->dev = dev;
+    slot->ino = ino;
+    s->count++;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  return slot != NULL;
+}
+
+/*
+ * Stores the usage of the directory path, open as dirfd, with the entries
+ * in list, not counting subdirectories, in u.
+ * Threads may call this concurrently.
+ */
+void
+usage_dir(const char *path, int dirfd, const struct entry_list *list,
+  struct usage *u)
+{
+  struct stat sb;
+  int i;
+
+  assert((path != NULL) && (list != NULL) && (u != NULL)
+    && (list->blocks != NULL) && (list->size != NULL)
+    && (list->nlink != NULL));
+
+  if (fstat(dirfd, &sb) < 0)
+    err(EXIT_FAILURE, "fstat error for %s", path);
+  u->blocks = sb.st_blocks;
+  u->bytes = sb.st_size;
+  for (i = 0; i < list->count; i++) {
+    if (S_ISDIR(list->mode[i]))
+      continue;
+    /* entries do not cross mount points, unless they are directories */
+    if ((list->nlink[i] > 1) && (list->ino != NULL)
+      && !file_first_seen(sb.st_dev, list->ino[i]))
+      continue;
+    u->blocks += list->blocks[i];
+    u->bytes += list->size[i];
+  }
+}
+
+/*
+ * Adds the usage from to the usage to.
+ */
+void
+usage_add(struct usage *to, const struct usage *from)
+{
+  assert((to != NULL) && (from != NULL));
+
+  to->blocks += from->blocks;
+  to->bytes += from->bytes;
+}
+
+/*
+ * Appends the line of the directory path with the given usage to the
+ * report, which usage_print prints.
+ */
+void
+usage_report(const char *path, const struct usage *u, struct flags *flag)
+{
+  char buf[LINE_SIZE];
+  char *buf_ptr;
+  size_t remain;
+  size_t length;
+  int printed;
+
+  assert((path != NULL) && (u != NULL) && (flag != NULL));
+
+  buf_ptr = buf;
+  remain = LINE_SIZE;
+  print_blks(&buf_ptr, &remain, u->blocks, flag);
+  printed = snprintf(buf_ptr, remain, " %lld ", (long long)u->bytes);
+  if ((printed < 0) || ((size_t)printed >= remain))
+    errx(EXIT_FAILURE, "print usage error");
+  buf_ptr += printed;
+  remain -= printed;
+  print_name(&buf_ptr, &remain, path, flag);
+
+  length = buf_ptr - buf;
+  if (report.len + length + 1 > report.size) {
+    size_t size = (report.size == 0) ? LINE_SIZE : report.size;
+
+    while (report.len + length + 1 > size)
+      size *= 2;
+    if ((report.buf = (char *)realloc(report.buf, size)) == NULL)
+      err(EXIT_FAILURE, "not enough memory for the usage report");
+    report.size = size;
+  }
+  memcpy(report.buf + report.len, buf, length);
+  report.len += length;
+  report.buf[report.len++] = '\n';
+}
+
+/*
+ * Prints the report lines collected so far after an empty line and
+ * empties the report.
+ */
+void
+usage_print(void)
+{
+  if (report.len == 0)
+    return;
+  output_char('\n');
+  output_write(report.buf, report.len);
+  report.len = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef _USAGE_H_
+#define _USAGE_H_
+
+#include <sys/types.h>
+
+#include "entries.h"
+#include "util.h"
+
+/* number of independently locked parts of the set of hard-linked files */
+#define USAGE_STRIPES 64
+/* initial number of slots of each part */
+#define USAGE_STRIPE_SIZE 64
+
+/*
+ * Disk usage of a directory and everything below it (D flag).
+ */
+struct usage {
+  blkcnt_t blocks;    /* 512 byte blocks */
+  off_t bytes;        /* apparent size */
+};
+
+void usage_dir(const char *, int, const struct entry_list *, struct usage *);
+void usage_add(struct usage *, const struct usage *);
+void usage_report(const char *, const struct usage *, struct flags *);
+void usage_print(void);
+
+#endif /* !_USAGE_H_ */
@@ -1,133 +1,112 @@
+#define _GNU_SOURCE
+
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 
 #include <assert.h>
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <bsd/stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "entries.h"
+#include "metadata.h"
+#include "stats.h"
 #include "util.h"
 
-enum sort_type sort_key;
-int reverse;
-
-/*
- * Comparison function that returns a negative integer, if p1 is less than p2
- * according to sort_key.
- * Returns zero, if p1 equals p2.
- * Otherwise, returns a positive integer.
- * Set sort_key before running this function.
- * reverse which determines if the order is to be reversed must be set
- * beforehand.
- */
-int
-cmp(const void *p1, const void *p2)
-{
-  int res;
-
-  assert((p1 != NULL) && (p2 != NULL));
-
-  if (sort_key == SORT_LEXICO) {
-    char const *name1;
-    char const *name2;
-
-    name1 = (* (struct file_entry const *)p1).name;
-    name2 = (* (struct file_entry const *)p2).name;
-    res = strcasecmp(name1, name2);
-  } else {
-    struct stat const *sb1;
-    struct stat const *sb2;
-
-    sb1 = &((* (struct file_entry const *)p1).sb);
-    sb2 = &((* (struct file_entry const *)p2).sb);
-
-    res = -1;
-
-    switch (sort_key) {
-    case SORT_SIZE:
-      if (sb1->st_size < sb2->st_size)
-        res = 1;
-      else if (sb1->st_size == sb2->st_size)
-        res = 0;
-      break;
-    case SORT_ATIME:
-      if (sb1->st_atime < sb2->st_atime)
-        res = 1;
-      else if (sb1->st_atime == sb2->st_atime)
-        res = 0;
-      break;
-    case SORT_MTIME:
-      if (sb1->st_mtime < sb2->st_mtime)
-        res = 1;
-      else if (sb1->st_mtime == sb2->st_mtime)
-        res = 0;
-      break;
-    case SORT_CTIME:
-      if (sb1->st_ctime < sb2->st_ctime)
-        res = 1;
-      else if (sb1->st_ctime == sb2->st_ctime)
-        res = 0;
-      break;
-    default:
-      errx(EXIT_FAILURE, "unknown sort key %d", sort_key);
-      /* NOTREACHED */
-    }
- }
-
-  if (reverse)
-    return -res;
-  else
-    return res;
-}
-
 /*
  * Sorts the given paths lexicographically and such that
  * files come before directory paths. Also retrieves the
  * stat(2) information for each file and stores that along
- * with the file name in entries. Make sure to allocate
- * pathc elements for entries.
- * Returns the number of non-directory files.
+ * with the file name in list, which must be initialized for the fields
+ * of stat_request_init and empty. The paths are stat(2)ed with the backend
+ * selected in flag, so many operands are handled concurrently.
+ * Returns the number of non-directory files, which come first in
+ * list->order.
  */
 int
-stat_and_sort(char *path[], int pathc, struct file_entry *entries)
+stat_and_sort(char *path[], int pathc, struct entry_list *list,
+  struct flags *flag)
 {
+  struct stat_request req;
+  struct sort_spec spec;
+  int *todo;
   int non_dirc;
+  int failed;
   int i;
 
-  assert((path != NULL) && (pathc >= 0) && (entries != NULL));
+  assert((path != NULL) && (pathc >= 0) && (list != NULL) && (flag != NULL));
+
+  if ((todo = (int *)calloc(pathc + 1, sizeof(int))) == NULL)
+    err(EXIT_FAILURE, "not enough memory for paths");
+  for (i = 0; i < pathc; i++) {
+    if ((todo[i] = entries_add(list, path[i], 0, 0)) < 0)
+      err(EXIT_FAILURE, "not enough memory for path %s", path[i]);
+  }
+  stat_request_init(&req, flag);
+  failed = 0;
+  /* the first operand which fails is reported, as if done one by one */
+  if (stat_entries(AT_FDCWD, list, todo, NULL, pathc, &req, flag, &failed)
+    < 0)
+    err(EXIT_FAILURE, "lstat error for path %s", path[failed]);
+  free(todo);
 
+  sort_spec_init(&spec, SORT_LEXICO, 0);
   non_dirc = 0;
   for (i = 0; i < pathc; i++) {
-    struct stat sb;
     int p;
 
     /*
-     * Add directories from the end of sorted_path and add file
+     * Add directories from the end of the order and add file
      * names from the front.
      */
-    if (lstat(path[i], &sb) < 0)
-      err(EXIT_FAILURE, "lstat error for path %s", path[i]);
-    p = (S_ISDIR(sb.st_mode)) ? (pathc - 1 - i + non_dirc) : non_dirc;
-    entries[p].sb = sb;
-    if (strlen(path[i]) >= sizeof(entries[p].name))
-      errx(EXIT_FAILURE, "path %s too long", path[i]);
-    strncpy(entries[p].name, path[i], sizeof(entries[p].name));
-    if (!S_ISDIR(sb.st_mode))
+    p = (S_ISDIR(list->mode[i])) ? (pathc - 1 - i + non_dirc) : non_dirc;
+    list->order[p] = i;
+    if (!S_ISDIR(list->mode[i]))
       non_dirc++;
   }
 
-  reverse = 0;
-  sort_key = SORT_LEXICO;
-  qsort(entries, non_dirc, sizeof(entries[0]), cmp);
-  qsort(entries + non_dirc, pathc - non_dirc, sizeof(entries[0]), cmp);
+  sort_order(list, list->order, non_dirc, &spec);
+  sort_order(list, list->order + non_dirc, pathc - non_dirc, &spec);
 
   return non_dirc;
 }
 
+/*
+ * Stores the path of the file name in the directory dir in path, which
+ * holds PATH_MAX bytes, like full_path does, but without terminating the
+ * process.
+ * Returns 0 on success and -1, if the path does not fit.
+ */
+int
+path_join(char *path, const char *dir, const char *name)
+{
+  size_t dir_length;
+  size_t name_length;
+  int slash;
+
+  assert((path != NULL) && (dir != NULL) && (name != NULL));
+
+  dir_length = strlen(dir);
+  name_length = strlen(name);
+  slash = (name_length > 0) && (dir_length > 0)
+    && (dir[dir_length - 1] != '/');
+  if ((dir_length + slash + name_length + 1) > PATH_MAX)
+    return -1;
+  memcpy(path, dir, dir_length);
+  if (slash)
+    path[dir_length] = '/';
+  memcpy(path + dir_length + slash, name, name_length + 1);
+
+  return 0;
+}
+
 /*
  * Appends given file name (second name) to the directory name (first
  * argument). The argument may be empty but not NULL.
@@ -137,7 +116,6 @@ char *
 full_path(const char *dir, const char *name)
 {
   char *path;
-  int length;
  
   assert((dir != NULL) && (name != NULL));
 
@@ -145,40 +123,127 @@ full_path(const char *dir, const char *name)
   if (path == NULL)
     err(EXIT_FAILURE, "not enough memory for path name: dir(%s) name(%s)",
       dir, name);
-  length = strlen(dir);
   /* path_file must fit directory name + '/' + file name + '\0' */
-  if ((length + NAME_MAX + 2) > PATH_MAX)
-    errx(EXIT_FAILURE, "path name %s too long", path);
-  strcpy(path, dir);
-  /* append name */
-  if (strlen(name) > 0) {
-    /* append '/' to path name, if necessary */
-    if ((length > 0) && (dir[length - 1] != '/')) {
-      path[length] = '/';
-      length++;
-      path[length] = 0;
-    }
-    /* append the file name to directory name */
-    strcpy(path + length, name);
-  }
+  if (((strlen(dir) + NAME_MAX + 2) > PATH_MAX)
+    || (path_join(path, dir, name) < 0))
+    errx(EXIT_FAILURE, "path name %s too long", dir);
 
   return path;
 }
 
 /*
- * Calls lstat(2) on the given file and stores the result in sb.
+ * Derives the statx(2) field mask and flags from the given flags, so that
+ * only the fields which are displayed or sorted on are requested.
  */
 void
-lstat_path(const char *dir, const char *file, struct stat *sb)
+stat_request_init(struct stat_request *req, struct flags *flag)
 {
-  char *path;
+  unsigned int time_mask;
+
+  assert((req != NULL) && (flag != NULL));
+
+  if (flag->cflag)
+    time_mask = STATX_CTIME;
+  else if (flag->uflag)
+    time_mask = STATX_ATIME;
+  else
+    time_mask = STATX_MTIME;
+
+  req->mask = STATX_TYPE | STATX_MODE;
+  if (flag->iflag)
+    req->mask |= STATX_INO;
+  if (flag->sflag)
+    req->mask |= STATX_BLOCKS;
+  if (flag->lflag || flag->nflag)
+    req->mask |= STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE
+      | STATX_BLOCKS | time_mask;
+  if (flag->tflag)
+    req->mask |= time_mask;
+  if (flag->Sflag)
+    req->mask |= STATX_SIZE;
+  /* cumulative usage, counting files with several links once */
+  if (flag->Dflag)
+    req->mask |= STATX_INO | STATX_NLINK | STATX_SIZE | STATX_BLOCKS;
+  /* machine-readable records carry all fields */
+  if (flag->machine != MACHINE_NONE)
+    req->mask |= STATX_INO | STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE
+      | STATX_BLOCKS | STATX_ATIME | STATX_MTIME | STATX_CTIME;
+  req->mask |= flag->stat_mask;
+
+  req->flags = AT_SYMLINK_NOFOLLOW;
+  if (flag->dont_sync)
+    req->flags |= AT_STATX_DONT_SYNC;
+}
+
+/*
+ * Converts the statx(2) result stx to a stat structure.
+ */
+void
+statx_to_stat(const struct statx *stx, struct stat *sb)
+{
+  assert((stx != NULL) && (sb != NULL));
+
+  memset(sb, 0, sizeof(*sb));
+  sb->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  sb->st_ino = stx->stx_ino;
+  sb->st_mode = stx->stx_mode;
+  sb->st_nlink = stx->stx_nlink;
+  sb->st_uid = stx->stx_uid;
+  sb->st_gid = stx->stx_gid;
+  sb->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+  sb->st_size = stx->stx_size;
+  sb->st_blksize = stx->stx_blksize;
+  sb->st_blocks = stx->stx_blocks;
+  sb->st_atim.tv_sec = stx->stx_atime.tv_sec;
+  sb->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+  sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+  sb->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+  sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
 
-  assert ((dir != NULL) && (file != NULL) && (sb != NULL));
+/*
+ * Retrieves the fields in req of the file name relative to the directory
+ * dirfd, without following symbolic links. Falls back to fstatat(2) when the
+ * kernel lacks statx(2).
+ * Returns 0 on success and -1 on failure.
+ */
+int
+statx_at(int dirfd, const char *name, const struct stat_request *req,
+  struct stat *sb)
+{
+  static int no_statx;
+  struct statx stx;
+
+  assert((name != NULL) && (req != NULL) && (sb != NULL));
+
+  STATS_COUNT(STATS_STATX, 1);
+  if (!no_statx) {
+    if (statx(dirfd, name, req->flags, req->mask, &stx) == 0) {
+      statx_to_stat(&stx, sb);
+      return 0;
+    }
+    if (errno != ENOSYS)
+      return -1;
+    no_statx = 1;
+  }
 
-  path = full_path(dir, file);
-  if (lstat(path, sb) < 0)
-    err(EXIT_FAILURE, "lstat_path lstat error for %s", path);
-  free(path);
+  return fstatat(dirfd, name, sb, AT_SYMLINK_NOFOLLOW);
+}
+
+/*
+ * Calls statx(2) on the given file relative to dirfd and stores the result
+ * in sb. dir is the path of dirfd and is only used in error messages.
+ */
+void
+lstat_path(const char *dir, int dirfd, const char *file,
+  const struct stat_request *req, struct stat *sb)
+{
+  assert ((dir != NULL) && (file != NULL) && (req != NULL) && (sb != NULL));
+
+  if (statx_at(dirfd, file, req, sb) < 0)
+    err(EXIT_FAILURE, "lstat_path lstat error for %s",
+      full_path(dir, file));
 }
 
 /*
@@ -213,7 +278,25 @@ display_file(const char *dir, const char *name, struct flags *flag)
 }
 
 /*
- * Sets all flags to zero.
+ * Returns whether the listing needs more lstat(2) information than the file
+ * type, which the directory entry usually provides already.
+ * The F flag additionally needs the mode bits of regular files; see
+ * statdir in ls.c.
+ */
+int
+needs_stat(struct flags *flag)
+{
+  int sorted;
+
+  assert(flag != NULL);
+  sorted = !flag->fflag && (flag->tflag || flag->Sflag);
+  return flag->lflag || flag->nflag || flag->sflag || flag->iflag || sorted
+    || flag->Dflag || (flag->machine != MACHINE_NONE)
+    || ((flag->stat_mask & ~STATX_TYPE) != 0);
+}
+
+/*
+ * Sets all flags to zero and the tuning parameters to their defaults.
  */
 void
 flags_init(struct flags *flag)
@@ -223,6 +306,7 @@ flags_init(struct flags *flag)
   flag->aflag = 0;
   flag->cflag = 0;
   flag->Cflag = 0;
+  flag->Dflag = 0;
   flag->dflag = 0;
   flag->Fflag = 0;
   flag->fflag = 0;
@@ -238,7 +322,26 @@ flags_init(struct flags *flag)
   flag->sflag = 0;
   flag->tflag = 0;
   flag->uflag = 0;
+  flag->Wflag = 0;
   flag->wflag = 0;
   flag->xflag = 0;
   flag->oneflag = 0;
+  flag->machine = MACHINE_NONE;
+  flag->limit = 0;
+  filters_init(&flag->filters);
+  flag->stat_mask = 0;
+  flag->rval = EXIT_SUCCESS;
+  flag->dont_sync = 0;
+  flag->stat_threads = 1;
+  flag->stat_backend = STAT_SYNC;
+  flag->uring_depth = URING_DEPTH;
+  flag->inode_order = STAT_INODE_ORDER;
+  flag->walk_threads = 1;
+  flag->preload_names = 0;
+  flag->stream_long = 0;
+  flag->output_flush = FLUSH_AUTO;
+  sort_spec_init(&flag->sort, SORT_LEXICO, 0);
+  flag->cache_dir = NULL;
+  flag->memory = 0;
+  flag->spill_dir = "/tmp";
 }
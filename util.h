@@ -7,11 +7,26 @@
 #include <limits.h>
 #include <unistd.h>
 
+#include "filter.h"
+#include "machine.h"
+#include "output.h"
+#include "sort.h"
+
+/*
+ * Ways of collecting file metadata. See metadata.c.
+ */
+enum stat_backend {
+  STAT_SYNC,
+  STAT_THREADS,
+  STAT_URING
+};
+
 struct flags {
   int Aflag;
   int aflag;
   int Cflag;
   int cflag;
+  int Dflag;
   int dflag;
   int Fflag;
   int fflag;
@@ -27,36 +42,54 @@ struct flags {
   int sflag;
   int tflag;
   int uflag;
+  int Wflag;
   int wflag;
   int xflag;
   int oneflag;
-};
-
-struct file_entry {
-  char name[NAME_MAX + 1];
-  struct stat sb;
-};
-
-enum sort_type {
-  SORT_LEXICO,
-  SORT_SIZE,
-  SORT_ATIME,
-  SORT_MTIME,
-  SORT_CTIME
+  enum machine_format machine;   /* M flag */
+  int limit;                     /* N flag, 0 for no limit */
+  struct filters filters;        /* I and X flags */
+  unsigned int stat_mask;        /* more statx(2) fields, see libls.c */
+  int rval;                      /* exit status, see print_link */
+  /* tuning, see the environment section in README.md */
+  int dont_sync;
+  int stat_threads;
+  enum stat_backend stat_backend;
+  int uring_depth;
+  int inode_order;
+  int walk_threads;
+  int preload_names;
+  int stream_long;
+  enum output_flush output_flush;
+  struct sort_spec sort;   /* see sort_init */
+  const char *cache_dir;   /* NULL unless LS_CACHE is set */
+  size_t memory;           /* LS_MEMORY in bytes, 0 for no budget */
+  const char *spill_dir;   /* temporary files of the budget, see spill.c */
 };
 
 /*
- * Parameters that influence sorting. See function cmp.
+ * Fields and flags passed to statx(2). See stat_request_init.
  */
-extern enum sort_type sort_key;
-extern int reverse;
+struct stat_request {
+  unsigned int mask;
+  int flags;
+};
+
+struct entry_list;
 
-int cmp(const void *, const void *);
-int stat_and_sort(char *[], int, struct file_entry *);
+int stat_and_sort(char *[], int, struct entry_list *, struct flags *);
+int path_join(char *, const char *, const char *);
 char *full_path(const char *, const char *);
-void lstat_path(const char *, const char *, struct stat *);
+void stat_request_init(struct stat_request *, struct flags *);
+struct statx;
+
+void statx_to_stat(const struct statx *, struct stat *);
+int statx_at(int, const char *, const struct stat_request *, struct stat *);
+void lstat_path(const char *, int, const char *, const struct stat_request *,
+  struct stat *);
 int is_dot_dir(const char *);
 int display_file(const char *, const char *, struct flags *);
+int needs_stat(struct flags *);
 void flags_init(struct flags *);
 
 #endif /* !_UTIL_H_ */
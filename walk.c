@@ -0,0 +1,618 @@
+/*
+ * Parallel recursive traversal (R flag).
+ * Worker threads read, stat and sort directories ahead of the calling
+ * thread, which prints them in exactly the order traverse in ls.c does.
+ * Each worker owns a queue of directories. It takes the newest directory
+ * from its own queue, which continues the traversal depth-first, and
+ * steals the oldest directory from another queue when its own is empty.
+ * Since errors are reported by the printing thread when it reaches the
+ * directory, the output is the same as that of the serial traversal.
+ * Without the R flag, the same workers read the directory operands ahead
+ * of the printing thread, see walk_operands.
+ */
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "entries.h"
+#include "listing.h"
+#include "print.h"
+#include "usage.h"
+#include "util.h"
+#include "walk.h"
+
+/*
+ * A directory of the traversal. A node is only created when a worker or the
+ * printing thread takes the directory; until then, it is no more than its
+ * name among the children of its parent.
+ */
+struct node {
+  char *path;
+  int depth;
+  int done;           /* read, stat(2)ed and sorted */
+  int in_queue;       /* the children are still referenced by a queue */
+  int orphan;         /* printed while queued; freed when dequeued */
+  int prefetched;     /* read by a worker */
+  int too_long;       /* has sub-directories whose paths exceed PATH_MAX */
+  int operands;       /* the children are the operands of walk_operands */
+  struct statdir_info info;
+  struct statdir_error *error;   /* NULL unless reading failed */
+  struct usage usage;   /* D flag, see usage.c */
+  /* the sub-directories in the order of the listing */
+  struct node **child;  /* NULL until taken */
+  uint32_t *name;       /* offsets of the packed names in names */
+  char *names;
+  int childc;
+};
+
+/*
+ * Children of a node which may still be taken: the owner of the queue
+ * takes the first one, thieves take the last one.
+ */
+struct range {
+  struct node *parent;
+  int next;
+  int end;
+};
+
+/*
+ * Queue of the children of read directories. The owner pushes and takes at
+ * the bottom, thieves take at the top.
+ */
+struct queue {
+  struct range *range;
+  size_t top;
+  size_t bottom;
+  size_t size;
+};
+
+static struct {
+  pthread_mutex_t lock;   /* protects everything below and all nodes */
+  pthread_cond_t work;    /* children were queued or the window moved */
+  pthread_cond_t done;    /* a node was read */
+  struct queue *queue;    /* queue[0] is filled by the printing thread */
+  int queues;
+  int prefetched;         /* nodes read by workers and not yet printed */
+  int window;
+  struct flags *flag;
+} walker = {
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  NULL,
+  0,
+  0,
+  0,
+  NULL
+};
+
+/*
+ * A directory of walk_print whose sub-directories are being printed.
+ */
+struct walk_frame {
+  struct node *node;
+  int next;   /* index of the next child to print */
+};
+
+/*
+ * Returns a new node for the given path, which is taken over.
+ */
+static struct node *
+node_new(char *path, int depth)
+{
+  struct node *node;
+
+  if ((node = (struct node *)calloc(1, sizeof(struct node))) == NULL)
+    err(EXIT_FAILURE, "not enough memory for directory %s", path);
+  node->path = path;
+  node->depth = depth;
+
+  return node;
+}
+
+/*
+ * Frees the node.
+ */
+static void
+node_free(struct node *node)
+{
+  free(node->child);
+  free(node->error);
+  free(node->path);
+  free(node);
+}
+
+/*
+ * Allocates the children of node, childc sub-directories whose names take
+ * names_len bytes, in one block: the child pointers, the offsets and the
+ * packed names.
+ */
+static void
+node_children(struct node *node, size_t names_len, int childc)
+{
+  node->childc = childc;
+  if (childc == 0)
+    return;
+  node->child = (struct node **)calloc(1, (sizeof(struct node *)
+    + sizeof(uint32_t)) * childc + names_len);
+  if (node->child == NULL)
+    err(EXIT_FAILURE, "not enough memory for directory %s", node->path);
+  node->name = (uint32_t *)(node->child + childc);
+  node->names = (char *)(node->name + childc);
+}
+
+/*
+ * Appends name as child i of node. The children before i are set already.
+ */
+static void
+node_name(struct node *node, int i, const char *name)
+{
+  size_t pos;
+
+  pos = (i == 0) ? 0
+    : (node->name[i - 1] + strlen(node->names + node->name[i - 1]) + 1);
+  node->name[i] = pos;
+  strcpy(node->names + pos, name);
+}
+
+/*
+ * Returns a new node for child i of parent and records that it is taken.
+ * The lock must be held.
+ */
+static struct node *
+node_take(struct node *parent, int i)
+{
+  const char *name;
+  char *path;
+  struct node *node;
+
+  assert((i >= 0) && (i < parent->childc) && (parent->child[i] == NULL));
+
+  name = parent->names + parent->name[i];
+  if (parent->operands) {
+    /* operands are taken as given; their depth is their position */
+    if ((path = strdup(name)) == NULL)
+      err(EXIT_FAILURE, "not enough memory for directory %s", name);
+    node = node_new(path, parent->depth + i);
+  } else {
+    /* exactly the bytes needed, children_fit holds for parent */
+    path = (char *)malloc(strlen(parent->path) + strlen(name) + 2);
+    if (path == NULL)
+      err(EXIT_FAILURE, "not enough memory for directory %s", parent->path);
+    (void)path_join(path, parent->path, name);
+    node = node_new(path, parent->depth + 1);
+  }
+  parent->child[i] = node;
+
+  return node;
+}
+
+/*
+ * Returns whether the children of a directory with the given path fit into
+ * PATH_MAX, as full_path in util.c requires.
+ */
+static int
+children_fit(const char *path)
+{
+  return (strlen(path) + NAME_MAX + 2) <= PATH_MAX;
+}
+
+/*
+ * Reads, stats and sorts the directory of node and stores the names of its
+ * sub-directories. Must be called without holding the lock.
+ */
+static void
+node_read(struct node *node)
+{
+  struct statdir_error error;
+  struct entry_list *list;
+  size_t names_len;
+  int childc;
+  int pass;
+  int i;
+
+  if (statdir(node->path, walker.flag, &node->info, &error) < 0) {
+    if ((node->error = (struct statdir_error *)malloc(sizeof(error)))
+      == NULL)
+      err(EXIT_FAILURE, "not enough memory for directory %s", node->path);
+    *node->error = error;
+    return;
+  }
+  list = &node->info.entries;
+
+  if (walker.flag->Dflag)
+    usage_dir(node->path, node->info.fd, list, &node->usage);
+  sort_entries(list, walker.flag);
+
+  if (!walker.flag->Rflag)
+    return;
+  /* count the sub-directories, then store their names */
+  names_len = 0;
+  for (pass = 0; pass < 2; pass++) {
+    childc = 0;
+    for (i = 0; i < list->count; i++) {
+      uint32_t index = list->order[i];
+      const char *name = ENTRY_NAME(list, index);
+
+      if (!S_ISDIR(list->mode[index]) || is_dot_dir(name))
+        continue;
+      if (!children_fit(node->path)) {
+        /* reported once the directory is printed, like traverse does */
+        node->too_long = 1;
+        return;
+      }
+      if (pass == 0)
+        names_len += strlen(name) + 1;
+      else
+        node_name(node, childc, name);
+      childc++;
+    }
+    if (pass == 0)
+      node_children(node, names_len, childc);
+  }
+}
+
+/*
+ * Appends the children of node to the bottom of queue, so that the first
+ * child is taken first by the owner of the queue. The lock must be held.
+ */
+static void
+queue_children(struct queue *queue, struct node *node)
+{
+  struct range *range;
+
+  if (node->childc == 0)
+    return;
+  if (queue->bottom == queue->size) {
+    if (queue->top > 0) {
+      /* reuse the space in front of the queue */
+      memmove(queue->range, queue->range + queue->top,
+        sizeof(struct range) * (queue->bottom - queue->top));
+      queue->bottom -= queue->top;
+      queue->top = 0;
+    } else {
+      queue->size = (queue->size == 0) ? 64 : (queue->size * 2);
+      queue->range = (struct range *)realloc(queue->range,
+        sizeof(struct range) * queue->size);
+      if (queue->range == NULL)
+        err(EXIT_FAILURE, "not enough memory for directory queue");
+    }
+  }
+  range = &queue->range[queue->bottom++];
+  range->parent = node;
+  range->next = 0;
+  range->end = node->childc;
+  node->in_queue = 1;
+  pthread_cond_broadcast(&walker.work);
+}
+
+/*
+ * Takes the next directory from queue, the first child of its bottom range
+ * if own is set and else the last child of its top range. Skips children
+ * which the printing thread has taken already and drops the ranges without
+ * any left. Returns NULL if there is no directory left. The lock must be
+ * held.
+ */
+static struct node *
+queue_take(struct queue *queue, int own)
+{
+  while (queue->top < queue->bottom) {
+    struct range *range;
+    struct node *parent;
+
+    range = own ? &queue->range[queue->bottom - 1] : &queue->range[queue->top];
+    parent = range->parent;
+    while (range->next < range->end) {
+      int i = own ? range->next++ : --range->end;
+
+      if (parent->child[i] == NULL)
+        return node_take(parent, i);
+    }
+    if (own)
+      queue->bottom--;
+    else
+      queue->top++;
+    parent->in_queue = 0;
+    if (parent->orphan)
+      node_free(parent);
+  }
+  queue->top = 0;
+  queue->bottom = 0;
+
+  return NULL;
+}
+
+/*
+ * Main loop of the worker owning queue number id.
+ */
+static void *
+walk_worker(void *arg)
+{
+  int id;
+
+  id = (int)(long)arg;
+  pthread_mutex_lock(&walker.lock);
+  for (;;) {
+    struct node *node;
+    int i;
+
+    /*
+     * queue[0] has no owner. Taking its bottom reads the directories in the
+     * order in which they are printed.
+     */
+    node = NULL;
+    if (walker.prefetched < walker.window) {
+      node = queue_take(&walker.queue[id], 1);
+      for (i = 1; (node == NULL) && (i < walker.queues); i++) {
+        int victim = (id + i) % walker.queues;
+
+        node = queue_take(&walker.queue[victim], victim == 0);
+      }
+    }
+    if (node == NULL) {
+      pthread_cond_wait(&walker.work, &walker.lock);
+      continue;
+    }
+
+    node->prefetched = 1;
+    walker.prefetched++;
+    pthread_mutex_unlock(&walker.lock);
+
+    node_read(node);
+    arena_reset(arena_scratch());
+
+    pthread_mutex_lock(&walker.lock);
+    node->done = 1;
+    queue_children(&walker.queue[id], node);
+    pthread_cond_broadcast(&walker.done);
+  }
+
+  return NULL;
+}
+
+/*
+ * Starts the given number of workers, unless they are running already.
+ */
+static void
+walk_start(struct flags *flag, int threads)
+{
+  struct rlimit limit;
+  int i;
+
+  if (walker.queue != NULL)
+    return;
+
+  walker.flag = flag;
+  walker.queues = threads + 1;
+  walker.queue = (struct queue *)calloc(walker.queues, sizeof(struct queue));
+  if (walker.queue == NULL)
+    err(EXIT_FAILURE, "not enough memory for directory queues");
+
+  /* every directory read ahead keeps its descriptor open */
+  walker.window = threads * WALK_WINDOW;
+  if ((getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    && (limit.rlim_cur != RLIM_INFINITY)
+    && ((rlim_t)walker.window > (limit.rlim_cur / 2)))
+    walker.window = limit.rlim_cur / 2;
+
+  for (i = 1; i < walker.queues; i++) {
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, walk_worker, (void *)(long)i) != 0)
+      err(EXIT_FAILURE, "cannot start directory worker");
+    pthread_detach(tid);
+  }
+}
+
+/*
+ * Prints child i of parent, reading it itself, if no worker has taken it.
+ * Returns the node of the child.
+ */
+static struct node *
+walk_list(struct node *parent, int i, int intro)
+{
+  struct flags *flag;
+  struct node *node;
+
+  flag = walker.flag;
+  pthread_mutex_lock(&walker.lock);
+  if ((node = parent->child[i]) == NULL) {
+    node = node_take(parent, i);
+    pthread_mutex_unlock(&walker.lock);
+    print_intro(node->path, intro, node->depth, flag);
+    node_read(node);
+    pthread_mutex_lock(&walker.lock);
+    node->done = 1;
+    queue_children(&walker.queue[0], node);
+  } else {
+    pthread_mutex_unlock(&walker.lock);
+    print_intro(node->path, intro, node->depth, flag);
+    pthread_mutex_lock(&walker.lock);
+    while (!node->done)
+      pthread_cond_wait(&walker.done, &walker.lock);
+  }
+  pthread_mutex_unlock(&walker.lock);
+
+  if (node->error != NULL)
+    statdir_fail(node->error);
+  print_listing(node->path, &node->info, flag);
+  spill_free(node->info.spill);
+  arena_reset(arena_scratch());
+  if (close(node->info.fd) < 0)
+    err(EXIT_FAILURE, "error closedir %s", node->path);
+  if (node->too_long)
+    errx(EXIT_FAILURE, "path name %s too long", node->path);
+  entries_free(&node->info.entries);
+
+  if (node->prefetched) {
+    pthread_mutex_lock(&walker.lock);
+    walker.prefetched--;
+    pthread_cond_broadcast(&walker.work);
+    pthread_mutex_unlock(&walker.lock);
+  }
+
+  return node;
+}
+
+/*
+ * Frees node once it is printed with its sub-directories, or leaves it to
+ * the queue which still refers to its children.
+ */
+static void
+node_release(struct node *node)
+{
+  pthread_mutex_lock(&walker.lock);
+  if (node->in_queue)
+    node->orphan = 1;
+  else
+    node_free(node);
+  pthread_mutex_unlock(&walker.lock);
+}
+
+/*
+ * Prints child i of parent and then its sub-directories depth-first, with
+ * an explicit stack like traverse in ls.c. For the D flag, reports the
+ * usage of every directory after its sub-directories.
+ */
+static void
+walk_print(struct node *parent, int i, int intro)
+{
+  struct walk_frame *stack;
+  int stack_size;
+  int top;
+
+  stack_size = WALK_STACK_SIZE;
+  stack = (struct walk_frame *)malloc(sizeof(struct walk_frame) * stack_size);
+  if (stack == NULL)
+    err(EXIT_FAILURE, "not enough memory for directory stack");
+  top = 0;
+  stack[top].node = walk_list(parent, i, intro);
+  stack[top].next = 0;
+
+  while (top >= 0) {
+    struct node *node = stack[top].node;
+    struct node *child;
+
+    if (stack[top].next == node->childc) {
+      /* all sub-directories are printed */
+      if (walker.flag->Dflag) {
+        usage_report(node->path, &node->usage, walker.flag);
+        if (top > 0)
+          usage_add(&stack[top - 1].node->usage, &node->usage);
+      }
+      node_release(node);
+      top--;
+      continue;
+    }
+    child = walk_list(node, stack[top].next++, intro);
+
+    if (++top == stack_size) {
+      stack_size *= 2;
+      stack = (struct walk_frame *)realloc(stack,
+        sizeof(struct walk_frame) * stack_size);
+      if (stack == NULL)
+        err(EXIT_FAILURE, "not enough memory for directory stack");
+    }
+    stack[top].node = child;
+    stack[top].next = 0;
+  }
+
+  free(stack);
+}
+
+/*
+ * Drops the ranges which are left in the queues at the end of a walk and
+ * frees their orphaned nodes. Every directory is printed by then, so none
+ * of them has a child left to take.
+ */
+static void
+walk_drain(void)
+{
+  int i;
+
+  pthread_mutex_lock(&walker.lock);
+  for (i = 0; i < walker.queues; i++)
+    (void)queue_take(&walker.queue[i], 1);
+  pthread_mutex_unlock(&walker.lock);
+}
+
+/*
+ * Lists the directories dir[0] to dir[dirc - 1], the children of a node
+ * which is not listed itself, with depth as the depth of the first one.
+ * For the D flag, usage_print follows each directory, if report is set.
+ */
+static void
+walk_dirs(char *dir[], int dirc, int depth, int intro, int report)
+{
+  struct node *operands;
+  size_t names_len;
+  int i;
+
+  if ((operands = (struct node *)calloc(1, sizeof(struct node))) == NULL)
+    err(EXIT_FAILURE, "not enough memory for directories");
+  operands->operands = 1;
+  operands->depth = depth;
+  names_len = 0;
+  for (i = 0; i < dirc; i++)
+    names_len += strlen(dir[i]) + 1;
+  node_children(operands, names_len, dirc);
+  for (i = 0; i < dirc; i++)
+    node_name(operands, i, dir[i]);
+
+  /* the bottom of queue[0] is read first */
+  pthread_mutex_lock(&walker.lock);
+  queue_children(&walker.queue[0], operands);
+  pthread_mutex_unlock(&walker.lock);
+
+  for (i = 0; i < dirc; i++) {
+    walk_print(operands, i, intro);
+    if (report && walker.flag->Dflag)
+      usage_print();
+  }
+
+  walk_drain();
+  node_release(operands);
+}
+
+/*
+ * Traverses the given directory like traverse in ls.c, but reads
+ * directories with flag->walk_threads worker threads.
+ * intro determines whether a directory pre-amble should be printed
+ * and depth determines the depth relative to the user-provided directory.
+ */
+void
+walk(const char *dir, struct flags *flag, int intro, int depth)
+{
+  assert((dir != NULL) && (flag != NULL));
+
+  walk_start(flag, flag->walk_threads);
+  walk_dirs((char **)&dir, 1, depth, intro, 0);
+}
+
+/*
+ * Lists the directories dir[0] to dir[dirc - 1] one after the other like
+ * walk does, with flag->walk_threads worker threads reading and sorting
+ * the directories, and, for the R flag, their sub-directories, ahead of
+ * the printing. For the D flag, usage_print follows each directory.
+ * intro determines whether a directory pre-amble should be printed.
+ */
+void
+walk_operands(char *dir[], int dirc, struct flags *flag, int intro)
+{
+  assert((dir != NULL) && (dirc >= 0) && (flag != NULL));
+
+  walk_start(flag, flag->walk_threads);
+  walk_dirs(dir, dirc, 0, intro, 1);
+}
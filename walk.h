@@ -0,0 +1,14 @@
+#ifndef _WALK_H_
+#define _WALK_H_
+
+#include "util.h"
+
+/* directories each worker may read ahead of the printing thread */
+#define WALK_WINDOW 16
+/* initial number of nested directories of walk_print */
+#define WALK_STACK_SIZE 16
+
+void walk(const char *, struct flags *, int, int);
+void walk_operands(char *[], int, struct flags *, int);
+
+#endif /* !_WALK_H_ */
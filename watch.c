@@ -0,0 +1,514 @@
+/*
+ * Listing directories again whenever they change (W flag).
+ * Each directory is read once and then kept up to date from inotify(7)
+ * events: only the named entries are stat(2)ed again and moved to their new
+ * position in the sorted order, so the work per event does not depend on
+ * the size of the directory. If the event queue overflows, events are lost
+ * and all directories are read again from scratch.
+ * The directories are only kept open while events are applied and printed,
+ * since an open descriptor delays the notification of their removal.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "entries.h"
+#include "listing.h"
+#include "output.h"
+#include "print.h"
+#include "sort.h"
+#include "util.h"
+#include "watch.h"
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+  | IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_ONLYDIR)
+
+/*
+ * A watched directory along with a hash table from names to entry indices.
+ * Slots hold the index plus one, zero marks a free slot.
+ */
+struct watch_dir {
+  const char *path;
+  int wd;                 /* watch descriptor or -1, once it is gone */
+  struct statdir_info info;
+  uint32_t *slot;
+  size_t slot_size;       /* a power of two */
+  int removed;            /* entries removed since the directory was read */
+};
+
+/*
+ * Returns the FNV-1a hash of name.
+ */
+static size_t
+name_hash(const char *name)
+{
+  uint32_t hash;
+
+  hash = 2166136261u;
+  for (; *name != 0; name++)
+    hash = (hash ^ (unsigned char)*name) * 16777619u;
+
+  return hash;
+}
+
+/*
+ * Returns the slot of the entry with the given name or the free slot where
+ * it would go.
+ */
+static size_t
+table_find(const struct watch_dir *dir, const char *name)
+{
+  const struct entry_list *list;
+  size_t mask;
+  size_t i;
+
+  list = &dir->info.entries;
+  mask = dir->slot_size - 1;
+  for (i = name_hash(name) & mask; dir->slot[i] != 0; i = (i + 1) & mask) {
+    if (strcmp(ENTRY_NAME(list, dir->slot[i] - 1), name) == 0)
+      break;
+  }
+
+  return i;
+}
+
+/*
+ * Fills the name table with all entries of the directory, such that at
+ * most half of the slots are used.
+ */
+static void
+table_build(struct watch_dir *dir)
+{
+  const struct entry_list *list;
+  size_t size;
+  int i;
+
+  list = &dir->info.entries;
+  for (size = WATCH_TABLE_SIZE; size < (size_t)list->count * 2; size *= 2)
+    ;
+  free(dir->slot);
+  if ((dir->slot = (uint32_t *)calloc(size, sizeof(uint32_t))) == NULL)
+    err(EXIT_FAILURE, "not enough memory for directory %s", dir->path);
+  dir->slot_size = size;
+  for (i = 0; i < list->count; i++)
+    dir->slot[table_find(dir, ENTRY_NAME(list, i))] = i + 1;
+}
+
+/*
+ * Frees slot i and moves later entries of its probe sequence back, so that
+ * lookups need no markers for removed names.
+ */
+static void
+table_remove(struct watch_dir *dir, size_t i)
+{
+  const struct entry_list *list;
+  size_t mask;
+  size_t j;
+
+  list = &dir->info.entries;
+  mask = dir->slot_size - 1;
+  dir->slot[i] = 0;
+  for (j = (i + 1) & mask; dir->slot[j] != 0; j = (j + 1) & mask) {
+    size_t home = name_hash(ENTRY_NAME(list, dir->slot[j] - 1)) & mask;
+
+    /* move the entry, unless its home lies cyclically in (i, j] */
+    if (((j > i) && ((home <= i) || (home > j)))
+      || ((j < i) && ((home <= i) && (home > j)))) {
+      dir->slot[i] = dir->slot[j];
+      dir->slot[j] = 0;
+      i = j;
+    }
+  }
+}
+
+/*
+ * Returns the position of the entry with the given index in the display
+ * order.
+ */
+static int
+order_find(const struct entry_list *list, uint32_t index, struct flags *flag)
+{
+  int i;
+
+  if (!flag->fflag)
+    return sort_position(list, list->order, list->count, index, &flag->sort);
+  for (i = 0; list->order[i] != index; i++)
+    ;
+
+  return i;
+}
+
+/*
+ * Moves the entry at position from of the display order to its sorted
+ * position among the other entries, or to the end for the f flag.
+ */
+static void
+order_place(struct entry_list *list, int from, struct flags *flag)
+{
+  uint32_t index;
+  int to;
+
+  index = list->order[from];
+  memmove(list->order + from, list->order + from + 1,
+    sizeof(uint32_t) * (list->count - 1 - from));
+  to = flag->fflag ? (list->count - 1) : sort_position(list, list->order,
+    list->count - 1, index, &flag->sort);
+  memmove(list->order + to + 1, list->order + to,
+    sizeof(uint32_t) * (list->count - 1 - to));
+  list->order[to] = index;
+}
+
+/*
+ * Removes the entry in the given slot from the directory.
+ */
+static void
+entry_remove(struct watch_dir *dir, size_t slot, struct flags *flag)
+{
+  struct entry_list *list;
+  uint32_t index;
+  uint32_t last;
+  int pos;
+
+  list = &dir->info.entries;
+  index = dir->slot[slot] - 1;
+  last = list->count - 1;
+  table_remove(dir, slot);
+
+  pos = order_find(list, index, flag);
+  memmove(list->order + pos, list->order + pos + 1,
+    sizeof(uint32_t) * (list->count - 1 - pos));
+  if (index != last) {
+    /* the last entry takes the place of the removed one */
+    const char *name = ENTRY_NAME(list, last);
+
+    list->count--;
+    pos = order_find(list, last, flag);
+    list->count++;
+    list->order[pos] = index;
+    dir->slot[table_find(dir, name)] = index + 1;
+  }
+  entries_remove(list, index);
+  dir->removed++;
+}
+
+/*
+ * Returns a descriptor of the directory, opening it, if necessary, or -1,
+ * if it cannot be opened anymore.
+ */
+static int
+dir_fd(struct watch_dir *dir)
+{
+  if (dir->info.fd < 0)
+    dir->info.fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  return dir->info.fd;
+}
+
+/*
+ * Closes the descriptor of the directory, if it is open.
+ */
+static void
+dir_close_fd(struct watch_dir *dir)
+{
+  if ((dir->info.fd >= 0) && (close(dir->info.fd) < 0))
+    err(EXIT_FAILURE, "error closedir %s", dir->path);
+  dir->info.fd = -1;
+}
+
+/*
+ * Closes the directory and frees its entries.
+ */
+static void
+dir_release(struct watch_dir *dir)
+{
+  dir_close_fd(dir);
+  entries_free(&dir->info.entries);
+}
+
+/*
+ * Reads the directory from scratch and stores the reason, if that fails,
+ * in e.
+ * Returns 0 on success and -1 on failure.
+ */
+static int
+dir_read(struct watch_dir *dir, struct flags *flag, struct statdir_error *e)
+{
+  int r;
+
+  r = statdir(dir->path, flag, &dir->info, e);
+  arena_reset(arena_scratch());
+  if (r < 0)
+    return -1;
+  sort_entries(&dir->info.entries, flag);
+  dir->removed = 0;
+  table_build(dir);
+
+  return 0;
+}
+
+/*
+ * Reads the directory again. If it is gone meanwhile, reports that and
+ * stops watching it.
+ * Returns the number of directories which are no longer watched.
+ */
+static int
+dir_reread(struct watch_dir *dir, int fd, struct flags *flag)
+{
+  struct statdir_error dir_error;
+
+  dir_release(dir);
+  if (dir_read(dir, flag, &dir_error) == 0)
+    return 0;
+  errno = dir_error.error;
+  if (errno != 0)
+    warn("%s", dir_error.msg);
+  else
+    warnx("%s", dir_error.msg);
+  inotify_rm_watch(fd, dir->wd);
+  dir->wd = -1;
+
+  return 1;
+}
+
+/*
+ * Applies the event for the entry name of the directory.
+ * Returns whether the listing changed.
+ */
+static int
+dir_event(struct watch_dir *dir, uint32_t mask, const char *name,
+  const struct stat_request *req, struct flags *flag)
+{
+  struct entry_list *list;
+  struct stat sb;
+  size_t slot;
+  int found;
+  int index;
+
+  list = &dir->info.entries;
+  if (!display_file(dir->path, name, flag)
+    || !filters_match(&flag->filters, name, 0))
+    return 0;
+  slot = table_find(dir, name);
+  found = dir->slot[slot] != 0;
+
+  if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+    if (!found)
+      return 0;
+    entry_remove(dir, slot, flag);
+    return 1;
+  }
+  /* without other fields, only a new entry or a new mode matter */
+  if (found && !needs_stat(flag) && !(flag->Fflag && (mask & IN_ATTRIB)))
+    return 0;
+
+  if ((dir_fd(dir) < 0) || (statx_at(dir->info.fd, name, req, &sb) < 0)) {
+    /* the entry or directory is gone and a later event removes it */
+    if ((errno == ENOENT) || (errno == ENOTDIR))
+      return 0;
+    err(EXIT_FAILURE, "lstat_path lstat error for %s",
+      full_path(dir->path, name));
+  }
+  if (found) {
+    int pos;
+
+    /* find the entry by its old values before moving it */
+    index = dir->slot[slot] - 1;
+    pos = order_find(list, index, flag);
+    entry_set_stat(list, index, &sb);
+    order_place(list, pos, flag);
+    return 1;
+  }
+
+  if ((index = entries_add(list, name, sb.st_mode, sb.st_ino)) < 0)
+    err(EXIT_FAILURE, "not enough memory for files names in %s", dir->path);
+  entry_set_stat(list, index, &sb);
+  order_place(list, list->count - 1, flag);
+  if ((size_t)list->count * 2 > dir->slot_size)
+    table_build(dir);
+  else
+    dir->slot[slot] = index + 1;
+
+  return 1;
+}
+
+/*
+ * Prints all directories which are still watched, after clearing the
+ * terminal or, if the output is not a terminal, after an empty line.
+ */
+static void
+watch_print(struct watch_dir *dir, int dirc, struct flags *flag, int intro,
+  int again)
+{
+  int depth;
+  int i;
+
+  if (again) {
+    if (isatty(STDOUT_FILENO))
+      output_write("\033[H\033[2J", 7);
+    else
+      output_char('\n');
+  }
+  depth = 0;
+  for (i = 0; i < dirc; i++) {
+    /* a directory which cannot be opened is about to be dropped */
+    if ((dir[i].wd < 0) || (dir_fd(&dir[i]) < 0))
+      continue;
+    print_intro(dir[i].path, intro, depth++, flag);
+    print_listing(dir[i].path, &dir[i].info, flag);
+    dir_close_fd(&dir[i]);
+  }
+  arena_reset(arena_scratch());
+  output_flush();
+}
+
+/*
+ * Returns the milliseconds left of the WATCH_DELAY after first, at least 0.
+ */
+static int
+burst_left(const struct timespec *first)
+{
+  struct timespec now;
+  long long elapsed;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    err(EXIT_FAILURE, "clock_gettime error");
+  elapsed = (long long)(now.tv_sec - first->tv_sec) * 1000
+    + (now.tv_nsec - first->tv_nsec) / 1000000;
+
+  return (elapsed >= WATCH_DELAY) ? 0 : (int)(WATCH_DELAY - elapsed);
+}
+
+/*
+ * Lists the directories path[0] to path[pathc - 1] and lists them again
+ * after every change, until none of them exists anymore.
+ * intro determines whether the names of the directories are printed.
+ */
+void
+watch(char *path[], int pathc, struct flags *flag, int intro)
+{
+  /* room for 16 events with the longest names, aligned for the events */
+  uint64_t events[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)
+    / sizeof(uint64_t)];
+  struct watch_dir *dir;
+  struct stat_request req;
+  struct statdir_error dir_error;
+  struct pollfd pfd;
+  int active;
+  struct timespec first;   /* of the first event of a burst */
+  int fd;
+  int r;
+  int i;
+
+  assert((path != NULL) && (pathc > 0) && (flag != NULL));
+
+  stat_request_init(&req, flag);
+  if ((fd = inotify_init1(IN_CLOEXEC)) < 0)
+    err(EXIT_FAILURE, "inotify_init1 error");
+  if ((dir = (struct watch_dir *)calloc(pathc, sizeof(*dir))) == NULL)
+    err(EXIT_FAILURE, "not enough memory for directories");
+  for (i = 0; i < pathc; i++) {
+    dir[i].path = path[i];
+    /* watch before reading, so that no change is missed in between */
+    if ((dir[i].wd = inotify_add_watch(fd, path[i], WATCH_EVENTS)) < 0)
+      err(EXIT_FAILURE, "inotify_add_watch error for %s", path[i]);
+    if (dir_read(&dir[i], flag, &dir_error) < 0)
+      statdir_fail(&dir_error);
+  }
+  active = pathc;
+  watch_print(dir, pathc, flag, intro, 0);
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while (active > 0) {
+    int changed;
+    int timeout;
+
+    /*
+     * Block for the first event, then collect the rest of the burst, but
+     * print at the latest WATCH_DELAY ms after its first event, so that a
+     * steady stream of changes is still shown.
+     */
+    changed = 0;
+    timeout = -1;
+    while ((r = poll(&pfd, 1, timeout)) != 0) {
+      ssize_t length;
+      char *p;
+
+      if (r < 0) {
+        if (errno == EINTR)
+          continue;
+        err(EXIT_FAILURE, "error polling inotify events");
+      }
+      if ((length = read(fd, events, sizeof(events))) < 0) {
+        if (errno == EINTR)
+          continue;
+        err(EXIT_FAILURE, "error reading inotify events");
+      }
+      if ((timeout < 0) && (clock_gettime(CLOCK_MONOTONIC, &first) < 0))
+        err(EXIT_FAILURE, "clock_gettime error");
+      for (p = (char *)events; p < (char *)events + length;
+          p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+      {
+        const struct inotify_event *ev = (const struct inotify_event *)p;
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+          /* events were lost, so nothing but reading again is correct */
+          for (i = 0; i < pathc; i++) {
+            if (dir[i].wd >= 0)
+              active -= dir_reread(&dir[i], fd, flag);
+          }
+          changed = 1;
+          continue;
+        }
+        for (i = 0; (i < pathc) && (dir[i].wd != ev->wd); i++)
+          ;
+        if (i == pathc)
+          continue;
+        if (ev->mask & IN_IGNORED) {
+          /* the directory was removed or unmounted */
+          dir_release(&dir[i]);
+          dir[i].wd = -1;
+          active--;
+          changed = 1;
+        } else if ((ev->len > 0)
+          && dir_event(&dir[i], ev->mask, ev->name, &req, flag))
+          changed = 1;
+      }
+      if ((timeout = burst_left(&first)) == 0)
+        break;
+    }
+
+    for (i = 0; i < pathc; i++) {
+      /* read again once the arena holds more removed names than entries */
+      if ((dir[i].wd >= 0) && (dir[i].removed > dir[i].info.entries.count)
+        && (dir[i].removed > WATCH_TABLE_SIZE)
+        && dir_reread(&dir[i], fd, flag)) {
+        active--;
+        changed = 1;
+      }
+    }
+    if (changed && (active > 0))
+      watch_print(dir, pathc, flag, intro, 1);
+  }
+
+  for (i = 0; i < pathc; i++)
+    free(dir[i].slot);
+  free(dir);
+  close(fd);
+}
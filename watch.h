@@ -0,0 +1,13 @@
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+#include "util.h"
+
+/* milliseconds from the first event of a burst until it is printed */
+#define WATCH_DELAY 100
+/* initial number of slots of the name table of each directory */
+#define WATCH_TABLE_SIZE 64
+
+void watch(char *[], int, struct flags *, int);
+
+#endif /* !_WATCH_H_ */